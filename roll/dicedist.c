@@ -0,0 +1,1200 @@
+//
+// Copyright © 2021-2022, David Priver
+//
+#ifndef DICEDIST_C
+#define DICEDIST_C
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <float.h>
+#include <math.h>
+#include "common_macros.h"
+#include "dicedist.h"
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#endif
+
+// Past this many multiply-adds a direct convolution loses to the FFT.
+enum {DICEDIST_DIRECT_CONVOLVE_LIMIT = 1 << 22};
+// Products and quotients enumerate every pair of values.
+enum {DICEDIST_MAX_PAIRS = 1 << 28};
+// Keeping the highest or lowest dice is a DP whose work is about
+// faces * keep * count * support.
+enum {DICEDIST_MAX_KEEP_WORK = 1 << 28};
+// --moments works out kept dice exactly while the DP is about this small,
+// so a node costs at most that no matter where it is in the tree.
+enum {DICEDIST_MOMENTS_EXACT_KEEP_WORK = 1 << 24};
+
+static inline DiceDistError dicedist_alloc(DiceDist* d, int64_t min, size_t count);
+static inline DiceDistError dicedist_point(DiceDist* d, int64_t value);
+static DiceDistError dicedist_copy(const DiceDist* src, DiceDist* out);
+static void dicedist_trim(DiceDist* d);
+static DiceDistError dicedist_convolve(const DiceDist* a, const DiceDist* b, DiceDist* out);
+static DiceDistError dicedist_convolve_fft(const DiceDist* a, const DiceDist* b, DiceDist* out);
+static DiceDistError dicedist_power(const DiceDist* base, uint32_t n, DiceDist* out);
+static DiceDistError dicedist_product(const DiceDist* a, const DiceDist* b, bool divide, DiceDist* out);
+static DiceDistError dicedist_compare(const DiceDist* a, const DiceDist* b, DiceParseBinOp op, DiceDist* out);
+static void dicedist_negate(DiceDist* d);
+static DiceDistError dicedist_not(const DiceDist* a, DiceDist* out);
+static DiceDistError dicedist_keep(uint32_t faces, uint32_t count, uint32_t keep, bool lowest, DiceDist* out);
+static inline uint32_t dicedist_explode_limit(uint32_t faces, uint32_t at);
+static DiceDistError dicedist_explode(uint32_t faces, uint32_t at, DiceDist* out);
+static void dicedist_summarize(const DiceDist* dist, DiceMoments* out);
+
+static inline
+DiceDistError
+dicedist_alloc(DiceDist* d, int64_t min, size_t count){
+    if(count > DICEDIST_MAX_SUPPORT) return DICEDIST_TOO_LARGE;
+    double* probs = calloc(count, sizeof(*probs));
+    if(!probs) return DICEDIST_OUT_OF_MEMORY;
+    d->min = min;
+    d->count = count;
+    d->probs = probs;
+    return DICEDIST_NO_ERROR;
+}
+
+static inline
+DiceDistError
+dicedist_point(DiceDist* d, int64_t value){
+    DiceDistError err = dicedist_alloc(d, value, 1);
+    if(err) return err;
+    d->probs[0] = 1.;
+    return DICEDIST_NO_ERROR;
+}
+
+static
+DiceDistError
+dicedist_copy(const DiceDist* src, DiceDist* out){
+    DiceDistError err = dicedist_alloc(out, src->min, src->count);
+    if(err) return err;
+    memcpy(out->probs, src->probs, src->count*sizeof(*src->probs));
+    return DICEDIST_NO_ERROR;
+}
+
+DICEDIST_API
+void
+dicedist_destroy(DiceDist* dist){
+    free(dist->probs);
+    *dist = (DiceDist){0};
+}
+
+// Drops zero probability values from both ends.
+static
+void
+dicedist_trim(DiceDist* d){
+    size_t lo = 0;
+    size_t hi = d->count;
+    while(hi > 1 && d->probs[hi-1] == 0.) hi--;
+    while(lo < hi-1 && d->probs[lo] == 0.) lo++;
+    if(lo)
+        memmove(d->probs, d->probs+lo, (hi-lo)*sizeof(*d->probs));
+    d->min += lo;
+    d->count = hi - lo;
+}
+
+static
+DiceDistError
+dicedist_convolve(const DiceDist* a, const DiceDist* b, DiceDist* out){
+    size_t count = a->count + b->count - 1;
+    if(count > DICEDIST_MAX_SUPPORT) return DICEDIST_TOO_LARGE;
+    if((double)a->count * (double)b->count > DICEDIST_DIRECT_CONVOLVE_LIMIT)
+        return dicedist_convolve_fft(a, b, out);
+    DiceDistError err = dicedist_alloc(out, a->min + b->min, count);
+    if(err) return err;
+    double* restrict o = out->probs;
+    for(size_t i = 0; i < a->count; i++){
+        double pa = a->probs[i];
+        if(pa == 0.) continue;
+        const double* restrict pb = b->probs;
+        for(size_t j = 0; j < b->count; j++)
+            o[i+j] += pa * pb[j];
+    }
+    return DICEDIST_NO_ERROR;
+}
+
+// In place radix-2 FFT. `n` must be a power of two and tw_re/tw_im hold
+// cos/-sin(2 pi k / n) for k < n/2.
+static
+void
+dicedist_fft(double* re, double* im, size_t n, const double* tw_re, const double* tw_im, bool inverse){
+    for(size_t i = 1, j = 0; i < n; i++){
+        size_t bit = n >> 1;
+        for(; j & bit; bit >>= 1)
+            j ^= bit;
+        j ^= bit;
+        if(i < j){
+            double t;
+            t = re[i]; re[i] = re[j]; re[j] = t;
+            t = im[i]; im[i] = im[j]; im[j] = t;
+        }
+    }
+    for(size_t len = 2; len <= n; len <<= 1){
+        size_t half = len >> 1;
+        size_t step = n / len;
+        for(size_t i = 0; i < n; i += len){
+            for(size_t k = 0; k < half; k++){
+                double wr = tw_re[k*step];
+                double wi = inverse? -tw_im[k*step] : tw_im[k*step];
+                size_t u = i + k;
+                size_t v = u + half;
+                double xr = re[v]*wr - im[v]*wi;
+                double xi = re[v]*wi + im[v]*wr;
+                re[v] = re[u] - xr;
+                im[v] = im[u] - xi;
+                re[u] += xr;
+                im[u] += xi;
+            }
+        }
+    }
+}
+
+static
+DiceDistError
+dicedist_convolve_fft(const DiceDist* a, const DiceDist* b, DiceDist* out){
+    size_t count = a->count + b->count - 1;
+    size_t n = 1;
+    int log2n = 0;
+    while(n < count){
+        n <<= 1;
+        log2n++;
+    }
+    double* buff = calloc(5*n, sizeof(*buff));
+    if(!buff) return DICEDIST_OUT_OF_MEMORY;
+    double* are = buff;
+    double* aim = buff + n;
+    double* bre = buff + 2*n;
+    double* bim = buff + 3*n;
+    double* tw_re = buff + 4*n;
+    double* tw_im = tw_re + n/2;
+    const double tau = 6.283185307179586476925286766559;
+    for(size_t k = 0; k < n/2; k++){
+        tw_re[k] = cos(tau * (double)k / (double)n);
+        tw_im[k] = -sin(tau * (double)k / (double)n);
+    }
+    memcpy(are, a->probs, a->count*sizeof(*are));
+    memcpy(bre, b->probs, b->count*sizeof(*bre));
+    dicedist_fft(are, aim, n, tw_re, tw_im, false);
+    dicedist_fft(bre, bim, n, tw_re, tw_im, false);
+    for(size_t i = 0; i < n; i++){
+        double r = are[i]*bre[i] - aim[i]*bim[i];
+        double im = are[i]*bim[i] + aim[i]*bre[i];
+        are[i] = r;
+        aim[i] = im;
+    }
+    dicedist_fft(are, aim, n, tw_re, tw_im, true);
+    DiceDistError err = dicedist_alloc(out, a->min + b->min, count);
+    if(err){
+        free(buff);
+        return err;
+    }
+    double biggest = 0.;
+    for(size_t i = 0; i < count; i++){
+        double p = are[i] / (double)n;
+        out->probs[i] = p;
+        if(p > biggest) biggest = p;
+    }
+    // Anything below the rounding noise of the transform is really zero
+    // (or too small to be distinguished from it).
+    double noise = biggest * DBL_EPSILON * 8 * (log2n+1);
+    for(size_t i = 0; i < count; i++)
+        if(out->probs[i] < noise)
+            out->probs[i] = 0.;
+    free(buff);
+    dicedist_trim(out);
+    return DICEDIST_NO_ERROR;
+}
+
+//
+// Sum of the highest (or lowest) `keep` of `count` dice.
+//
+// Goes through the faces from the best one down. If r dice haven't been
+// placed yet, they all show one of the m faces left, so the number showing
+// the current face is Binomial(r, 1/m). The first `keep` dice placed are the
+// ones kept, and once that many have been the sum is final.
+// The state is (dice left, sum so far).
+//
+static
+DiceDistError
+dicedist_keep(uint32_t faces, uint32_t count, uint32_t keep, bool lowest, DiceDist* out){
+    assert(faces && keep && keep < count);
+    size_t sums = (size_t)keep * faces + 1;
+    if(sums > DICEDIST_MAX_SUPPORT)
+        return DICEDIST_TOO_LARGE;
+    if((double)faces * keep * count * (double)sums > DICEDIST_MAX_KEEP_WORK)
+        return DICEDIST_TOO_LARGE;
+    size_t states = (size_t)(count + 1) * sums;
+    double* buff = calloc(2*states + count + 1, sizeof(*buff));
+    if(!buff) return DICEDIST_OUT_OF_MEMORY;
+    double* cur = buff;
+    double* next = buff + states;
+    // log(i!)
+    double* lfact = buff + 2*states;
+    for(uint32_t i = 0; i <= count; i++)
+        lfact[i] = lgamma((double)i + 1.);
+    DiceDistError err = dicedist_alloc(out, 0, sums);
+    if(err){
+        free(buff);
+        return err;
+    }
+    cur[(size_t)count * sums] = 1.;
+    for(uint32_t t = 0; t < faces; t++){
+        uint32_t v = lowest? t + 1 : faces - t;
+        uint32_t m = faces - t;
+        double lp = -log((double)m);
+        double lq = m > 1? log((double)(m - 1) / (double)m) : 0.;
+        memset(next, 0, states * sizeof(*next));
+        // Only states that haven't kept enough yet are left.
+        for(uint32_t r = count - keep + 1; r <= count; r++){
+            uint32_t placed = count - r;
+            for(size_t sum = 0; sum < sums; sum++){
+                double p = cur[r * sums + sum];
+                if(p == 0.) continue;
+                for(uint32_t c = 0; c <= r; c++){
+                    double w;
+                    // The last face left takes the rest.
+                    if(m == 1)
+                        w = c == r;
+                    else
+                        w = exp(lfact[r] - lfact[c] - lfact[r - c] + c * lp + (r - c) * lq);
+                    if(w == 0.) continue;
+                    uint32_t take = c < keep - placed? c : keep - placed;
+                    size_t s2 = sum + (size_t)take * v;
+                    if(placed + c >= keep)
+                        out->probs[s2] += p * w;
+                    else
+                        next[(r - c) * sums + s2] += p * w;
+                }
+            }
+        }
+        double* tmp = cur;
+        cur = next;
+        next = tmp;
+    }
+    free(buff);
+    dicedist_trim(out);
+    return DICEDIST_NO_ERROR;
+}
+
+//
+// Most explosions of a single die that are kept track of: the cap, or fewer
+// if chains that long are less likely than 2^-53.
+//
+static inline
+uint32_t
+dicedist_explode_limit(uint32_t faces, uint32_t at){
+    double p = (double)(faces - at + 1) / faces;
+    uint32_t kmax = 0;
+    for(double pk = p; kmax < DICEPARSE_MAX_EXPLOSIONS && pk >= 0x1p-53; pk *= p)
+        kmax++;
+    return kmax;
+}
+
+//
+// Distribution of a single exploding die.
+//
+// ex holds the chance of the first k rolls all exploding with a given sum,
+// and each step either ends the chain on a face below `at` or explodes
+// again. Both are a sum over a run of faces, so they're a difference of
+// prefix sums. After DICEPARSE_MAX_EXPLOSIONS the last roll ends the chain
+// whatever it shows.
+// Like the VM, chains less likely than 2^-53 are left out, so the
+// distribution stays short for dice that rarely explode.
+//
+static
+DiceDistError
+dicedist_explode(uint32_t faces, uint32_t at, DiceDist* out){
+    assert(at >= 2 && at <= faces);
+    uint32_t kmax = dicedist_explode_limit(faces, at);
+    // Sums 0 through (kmax+1)*faces.
+    size_t n = (size_t)(kmax + 1) * faces + 1;
+    if(n > DICEDIST_MAX_SUPPORT)
+        return DICEDIST_TOO_LARGE;
+    double* buff = calloc(2*n + 1, sizeof(*buff));
+    if(!buff) return DICEDIST_OUT_OF_MEMORY;
+    double* ex = buff;
+    double* prefix = buff + n;
+    DiceDistError err = dicedist_alloc(out, 0, n);
+    if(err){
+        free(buff);
+        return err;
+    }
+    double* acc = out->probs;
+    ex[0] = 1.;
+    for(uint32_t k = 0; k <= kmax; k++){
+        // ex is non-zero on [k*at, k*faces].
+        size_t lo = (size_t)k * at;
+        size_t hi = (size_t)k * faces;
+        prefix[lo] = 0.;
+        for(size_t s = lo; s <= hi; s++)
+            prefix[s+1] = prefix[s] + ex[s];
+        // prefix[i] is the sum of ex[lo..i-1], clamped to the run.
+        #define PREFIX(i) ((i) <= lo? 0. : (i) > hi+1? prefix[hi+1] : prefix[(i)])
+        uint32_t end = k == DICEPARSE_MAX_EXPLOSIONS? faces : at - 1;
+        for(size_t v = lo + 1; v <= hi + end; v++)
+            acc[v] += (PREFIX(v) - PREFIX(v >= end? v - end : 0)) / faces;
+        if(k == kmax) break;
+        memset(ex + lo, 0, (hi - lo + 1) * sizeof(*ex));
+        for(size_t v = lo + at; v <= hi + faces; v++)
+            ex[v] = (PREFIX(v - at + 1) - PREFIX(v >= faces? v - faces : 0)) / faces;
+        #undef PREFIX
+    }
+    free(buff);
+    dicedist_trim(out);
+    return DICEDIST_NO_ERROR;
+}
+
+// Sum of n independent copies of base, by repeated squaring.
+static
+DiceDistError
+dicedist_power(const DiceDist* base, uint32_t n, DiceDist* out){
+    DiceDist result = {0};
+    DiceDist sq = {0};
+    DiceDist tmp = {0};
+    DiceDistError err = dicedist_point(&result, 0);
+    if(err) return err;
+    err = dicedist_copy(base, &sq);
+    if(err) goto fail;
+    for(;;){
+        if(n & 1){
+            err = dicedist_convolve(&result, &sq, &tmp);
+            if(err) goto fail;
+            dicedist_destroy(&result);
+            result = tmp;
+        }
+        n >>= 1;
+        if(!n) break;
+        err = dicedist_convolve(&sq, &sq, &tmp);
+        if(err) goto fail;
+        dicedist_destroy(&sq);
+        sq = tmp;
+    }
+    dicedist_destroy(&sq);
+    *out = result;
+    return DICEDIST_NO_ERROR;
+
+    fail:
+    dicedist_destroy(&result);
+    dicedist_destroy(&sq);
+    return err;
+}
+
+static
+DiceDistError
+dicedist_product(const DiceDist* a, const DiceDist* b, bool divide, DiceDist* out){
+    if((double)a->count * (double)b->count > DICEDIST_MAX_PAIRS)
+        return DICEDIST_TOO_LARGE;
+    // First pass finds the range of the result.
+    int64_t lo = INT64_MAX;
+    int64_t hi = INT64_MIN;
+    for(size_t i = 0; i < a->count; i++){
+        if(a->probs[i] == 0.) continue;
+        int64_t x = a->min + (int64_t)i;
+        for(size_t j = 0; j < b->count; j++){
+            if(b->probs[j] == 0.) continue;
+            int64_t y = b->min + (int64_t)j;
+            int64_t v = divide? (y? x / y : 0) : x * y;
+            if(v < lo) lo = v;
+            if(v > hi) hi = v;
+        }
+    }
+    if((uint64_t)hi - (uint64_t)lo >= DICEDIST_MAX_SUPPORT)
+        return DICEDIST_TOO_LARGE;
+    DiceDistError err = dicedist_alloc(out, lo, (size_t)(hi - lo) + 1);
+    if(err) return err;
+    for(size_t i = 0; i < a->count; i++){
+        double pa = a->probs[i];
+        if(pa == 0.) continue;
+        int64_t x = a->min + (int64_t)i;
+        for(size_t j = 0; j < b->count; j++){
+            double pb = b->probs[j];
+            if(pb == 0.) continue;
+            int64_t y = b->min + (int64_t)j;
+            int64_t v = divide? (y? x / y : 0) : x * y;
+            out->probs[v - lo] += pa * pb;
+        }
+    }
+    return DICEDIST_NO_ERROR;
+}
+
+static
+DiceDistError
+dicedist_compare(const DiceDist* a, const DiceDist* b, DiceParseBinOp op, DiceDist* out){
+    // less[j] is P(b < b->min + j)
+    double* less = malloc((b->count+1)*sizeof(*less));
+    if(!less) return DICEDIST_OUT_OF_MEMORY;
+    less[0] = 0.;
+    for(size_t j = 0; j < b->count; j++)
+        less[j+1] = less[j] + b->probs[j];
+    double total = less[b->count];
+    double p_true = 0.;
+    double p_false = 0.;
+    for(size_t i = 0; i < a->count; i++){
+        double pa = a->probs[i];
+        if(pa == 0.) continue;
+        int64_t j = (int64_t)i + a->min - b->min;
+        // Probability that b is less than, equal to or greater than this
+        // value of a.
+        double lt, eq, gt;
+        if(j < 0){
+            lt = 0.; eq = 0.; gt = total;
+        }
+        else if(j >= (int64_t)b->count){
+            lt = total; eq = 0.; gt = 0.;
+        }
+        else {
+            lt = less[j]; eq = b->probs[j]; gt = total - less[j+1];
+        }
+        double t;
+        switch(op){
+            case DICEPARSE_EQ:         t = eq;      break;
+            case DICEPARSE_NOT_EQ:     t = lt + gt; break;
+            case DICEPARSE_LESS:       t = gt;      break;
+            case DICEPARSE_LESS_EQ:    t = gt + eq; break;
+            case DICEPARSE_GREATER:    t = lt;      break;
+            case DICEPARSE_GREATER_EQ: t = lt + eq; break;
+            default: unreachable();
+        }
+        p_true += pa * t;
+        p_false += pa * (lt + eq + gt - t);
+    }
+    free(less);
+    DiceDistError err = dicedist_alloc(out, 0, 2);
+    if(err) return err;
+    out->probs[0] = p_false;
+    out->probs[1] = p_true;
+    dicedist_trim(out);
+    return DICEDIST_NO_ERROR;
+}
+
+static
+void
+dicedist_negate(DiceDist* d){
+    for(size_t i = 0, j = d->count-1; i < j; i++, j--){
+        double t = d->probs[i];
+        d->probs[i] = d->probs[j];
+        d->probs[j] = t;
+    }
+    d->min = -(d->min + (int64_t)d->count - 1);
+}
+
+static
+DiceDistError
+dicedist_not(const DiceDist* a, DiceDist* out){
+    double p_zero = 0.;
+    if(a->min <= 0 && -a->min < (int64_t)a->count)
+        p_zero = a->probs[-a->min];
+    double p_nonzero = 0.;
+    for(size_t i = 0; i < a->count; i++)
+        if(a->min + (int64_t)i != 0)
+            p_nonzero += a->probs[i];
+    DiceDistError err = dicedist_alloc(out, 0, 2);
+    if(err) return err;
+    out->probs[0] = p_nonzero;
+    out->probs[1] = p_zero;
+    dicedist_trim(out);
+    return DICEDIST_NO_ERROR;
+}
+
+DICEDIST_API
+DiceDistError
+dicedist_pool(uint32_t faces, uint32_t count, DiceDist* out){
+    if(faces == 0 || count == 0)
+        return dicedist_point(out, 0);
+    if((uint64_t)count * (faces - 1) + 1 > DICEDIST_MAX_SUPPORT)
+        return DICEDIST_TOO_LARGE;
+    DiceDist die = {0};
+    DiceDistError err = dicedist_alloc(&die, 1, faces);
+    if(err) return err;
+    for(size_t i = 0; i < faces; i++)
+        die.probs[i] = 1. / (double)faces;
+    err = dicedist_power(&die, count, out);
+    dicedist_destroy(&die);
+    return err;
+}
+
+DICEDIST_API
+DiceDistError
+dicedist_compute(const DiceParseExprBuffer* buff, int index, DiceDist* out){
+    const DiceParseExpr* exprs = buff->exprs;
+    DiceParseExpr expr = exprs[index];
+    switch((DiceParseExpressionType)expr.type){
+        case DICEPARSE_NUMBER:
+            return dicedist_point(out, expr.primary);
+        case DICEPARSE_DIE:
+            return dicedist_pool(expr.primary, expr.secondary, out);
+        case DICEPARSE_GROUPING:
+            return dicedist_compute(buff, expr.primary, out);
+        case DICEPARSE_KEEP:{
+            DiceParseExpr die = exprs[expr.primary];
+            if(!die.primary || !die.secondary || !expr.secondary)
+                return dicedist_point(out, 0);
+            // Keeping them all is just the pool.
+            if(expr.secondary >= die.secondary)
+                return dicedist_compute(buff, expr.primary, out);
+            return dicedist_keep(die.primary, die.secondary, expr.secondary, expr.type2 == DICEPARSE_KEEP_LOWEST, out);
+        }
+        case DICEPARSE_CUSTOM:{
+            if(!expr.secondary)
+                return dicedist_point(out, 0);
+            const DiceParseCustomDie* c = &buff->customs[expr.primary];
+            uint64_t span = (uint64_t)((int64_t)c->max - c->min);
+            if(expr.secondary * span + 1 > DICEDIST_MAX_SUPPORT)
+                return DICEDIST_TOO_LARGE;
+            DiceDist die = {0};
+            DiceDistError err = dicedist_alloc(&die, c->min, span + 1);
+            if(err) return err;
+            for(uint32_t i = 0; i < c->count; i++){
+                const DiceParseFace* f = &buff->faces[c->first + i];
+                if(f->weight)
+                    die.probs[f->value - c->min] += (double)f->weight / (double)c->total_weight;
+            }
+            err = dicedist_power(&die, expr.secondary, out);
+            dicedist_destroy(&die);
+            return err;
+        }
+        case DICEPARSE_SUCCESS:{
+            DiceParseExpr die = exprs[expr.primary];
+            uint32_t lo, hi;
+            diceparse_success_range(expr, die.primary, &lo, &hi);
+            if(!die.secondary || lo == hi)
+                return dicedist_point(out, 0);
+            if(hi - lo == die.primary)
+                return dicedist_point(out, die.secondary);
+            uint32_t n = die.secondary;
+            double p = (double)(hi - lo) / die.primary;
+            DiceDistError err = dicedist_alloc(out, 0, (size_t)n + 1);
+            if(err) return err;
+            // Binomial, in logs so big pools don't underflow.
+            double lp = log(p), lq = log1p(-p);
+            double lfn = lgamma((double)n + 1.);
+            for(uint32_t k = 0; k <= n; k++)
+                out->probs[k] = exp(lfn - lgamma((double)k + 1.) - lgamma((double)(n - k) + 1.) + k * lp + (n - k) * lq);
+            dicedist_trim(out);
+            return DICEDIST_NO_ERROR;
+        }
+        case DICEPARSE_EXPLODE:{
+            DiceParseExpr die = exprs[expr.primary];
+            if(!die.primary || !die.secondary)
+                return dicedist_point(out, 0);
+            // Nothing explodes.
+            if(expr.secondary > die.primary)
+                return dicedist_compute(buff, expr.primary, out);
+            DiceDist one = {0};
+            DiceDistError err = dicedist_explode(die.primary, expr.secondary, &one);
+            if(err) return err;
+            if((uint64_t)die.secondary * (one.count - 1) + 1 > DICEDIST_MAX_SUPPORT){
+                dicedist_destroy(&one);
+                return DICEDIST_TOO_LARGE;
+            }
+            err = dicedist_power(&one, die.secondary, out);
+            dicedist_destroy(&one);
+            return err;
+        }
+        case DICEPARSE_UNARY:{
+            DiceDist a = {0};
+            DiceDistError err = dicedist_compute(buff, expr.primary, &a);
+            if(err) return err;
+            switch((DiceParseUnaryOp)expr.type2){
+                case DICEPARSE_PLUS:
+                    *out = a;
+                    return DICEDIST_NO_ERROR;
+                case DICEPARSE_NEG:
+                    dicedist_negate(&a);
+                    *out = a;
+                    return DICEDIST_NO_ERROR;
+                case DICEPARSE_NOT:
+                    err = dicedist_not(&a, out);
+                    dicedist_destroy(&a);
+                    return err;
+            }
+            unreachable();
+        }
+        case DICEPARSE_BINARY:{
+            DiceDist a = {0};
+            DiceDist b = {0};
+            DiceDistError err = dicedist_compute(buff, expr.primary, &a);
+            if(err) return err;
+            err = dicedist_compute(buff, expr.rhs, &b);
+            if(err){
+                dicedist_destroy(&a);
+                return err;
+            }
+            switch((DiceParseBinOp)expr.type2){
+                case DICEPARSE_ADD:
+                    err = dicedist_convolve(&a, &b, out);
+                    break;
+                case DICEPARSE_SUBTRACT:
+                    dicedist_negate(&b);
+                    err = dicedist_convolve(&a, &b, out);
+                    break;
+                case DICEPARSE_MULTIPLY:
+                    err = dicedist_product(&a, &b, false, out);
+                    break;
+                case DICEPARSE_DIVIDE:
+                    err = dicedist_product(&a, &b, true, out);
+                    break;
+                case DICEPARSE_EQ:
+                case DICEPARSE_NOT_EQ:
+                case DICEPARSE_LESS:
+                case DICEPARSE_LESS_EQ:
+                case DICEPARSE_GREATER:
+                case DICEPARSE_GREATER_EQ:
+                    err = dicedist_compare(&a, &b, expr.type2, out);
+                    break;
+            }
+            dicedist_destroy(&a);
+            dicedist_destroy(&b);
+            return err;
+        }
+    }
+    unreachable();
+}
+
+static
+void
+dicedist_summarize(const DiceDist* dist, DiceMoments* out){
+    double mean = 0.;
+    for(size_t i = 0; i < dist->count; i++)
+        mean += (double)(dist->min + (int64_t)i) * dist->probs[i];
+    double variance = 0.;
+    for(size_t i = 0; i < dist->count; i++){
+        double d = (double)(dist->min + (int64_t)i) - mean;
+        variance += d * d * dist->probs[i];
+    }
+    *out = (DiceMoments){
+        .mean = mean,
+        .variance = variance,
+        .min = dist->min,
+        .max = dist->min + (int64_t)dist->count - 1,
+    };
+}
+
+// Number of values from m->min to m->max, as a double so it can't overflow.
+static inline
+double
+dicedist_moments_span(const DiceMoments* m){
+    return (double)m->max - (double)m->min + 1.;
+}
+
+//
+// P(D <= d) for an integer valued D with the given mean and variance, by
+// the normal approximation with a continuity correction.
+//
+static inline
+double
+dicedist_normal_cdf(double d, double mean, double variance){
+    return 0.5 * erfc((mean - d - 0.5) / sqrt(2 * variance));
+}
+
+// A 0 or 1 that is 1 with probability p.
+static inline
+DiceMoments
+dicedist_bool(double p, bool estimated){
+    return (DiceMoments){
+        .mean = p,
+        .variance = p * (1 - p),
+        .min = 0,
+        .max = 1,
+        .estimated = estimated,
+    };
+}
+
+//
+// Whether the expression at `index` is equally likely to be any value in
+// its range: a single die, possibly negated, shifted by a number or in
+// parentheses. (So is a constant, which the caller can tell from its
+// moments.)
+//
+static
+bool
+dicedist_is_uniform(const DiceParseExprBuffer* buff, int index){
+    for(;;){
+        DiceParseExpr expr = buff->exprs[index];
+        switch((DiceParseExpressionType)expr.type){
+            case DICEPARSE_DIE:
+                return expr.primary && expr.secondary == 1;
+            case DICEPARSE_GROUPING:
+                index = expr.primary;
+                continue;
+            case DICEPARSE_UNARY:
+                if(expr.type2 == DICEPARSE_NOT)
+                    return false;
+                index = expr.primary;
+                continue;
+            case DICEPARSE_BINARY:
+                if(expr.type2 != DICEPARSE_ADD && expr.type2 != DICEPARSE_SUBTRACT)
+                    return false;
+                if(buff->exprs[expr.rhs].type == DICEPARSE_NUMBER)
+                    index = expr.primary;
+                else if(buff->exprs[expr.primary].type == DICEPARSE_NUMBER)
+                    index = expr.rhs;
+                else
+                    return false;
+                continue;
+            default:
+                return false;
+        }
+    }
+}
+
+//
+// P(a - b <= d) for independent a and b. If both are uniform over their
+// ranges this is exact, summing over the values of b (at most 65536 of
+// them, as dice have 16 bit faces). Otherwise it uses the normal
+// approximation.
+//
+static
+double
+dicedist_difference_cdf(const DiceMoments* a, bool a_uniform, const DiceMoments* b, bool b_uniform, int64_t d){
+    if(!a_uniform || !b_uniform)
+        return dicedist_normal_cdf((double)d, a->mean - b->mean, a->variance + b->variance);
+    double span_a = dicedist_moments_span(a);
+    double total = 0;
+    for(int64_t y = b->min; y <= b->max; y++){
+        // Values of a at most y + d.
+        double n = (double)(y + d) - (double)a->min + 1;
+        if(n < 0) n = 0;
+        if(n > span_a) n = span_a;
+        total += n;
+    }
+    return total / (span_a * dicedist_moments_span(b));
+}
+
+//
+// Estimates the sum of the highest (or lowest) `keep` of `count` dice.
+//
+// Treats the dice as continuous uniforms scaled up by faces. Writing the
+// order statistics as sums of the gaps between them, which are exchangeable
+// with known variance and covariance, gives the mean and variance of the
+// kept sum in closed form. The discrete dice add a half per die to the
+// mean and take a twelfth per die off the variance, as they do for a
+// whole pool.
+//
+static
+DiceMoments
+dicedist_keep_estimate(uint32_t faces, uint32_t count, uint32_t keep, bool lowest){
+    double n = count, k = keep, f = faces;
+    // Kept highest order statistic j (n-k < j <= n) is the sum of gaps
+    // 1 through j, so gap m is in a_m of the kept ones. Gap n+1 is in none.
+    double sum_a = k * (n - k + 1) + (k - 1) * k / 2;
+    double sum_a2 = k * k * (n - k + 1) + (k - 1) * k * (2 * k - 1) / 6;
+    double mean = sum_a / (n + 1);
+    double variance = ((n + 1) * sum_a2 - sum_a * sum_a) / ((n + 1) * (n + 1) * (n + 2));
+    // The lowest are mirror images of the highest.
+    if(lowest)
+        mean = k - mean;
+    variance = f * f * variance - k / 12;
+    mean = f * mean + k / 2;
+    // Ties between the dice make this worst when keeping a few of a lot of
+    // dice with few faces, where it can stray outside the range.
+    if(mean < k) mean = k;
+    if(mean > k * f) mean = k * f;
+    return (DiceMoments){
+        .mean = mean,
+        .variance = variance < 0? 0 : variance,
+        .min = keep,
+        .max = (int64_t)keep * faces,
+        .estimated = true,
+    };
+}
+
+//
+// Estimates the mean and E[x^2] of a / c for a constant c, rounded towards
+// zero, as if the remainder were uniform. Exact if a is a constant.
+//
+static
+void
+dicedist_divide_by(const DiceMoments* a, int64_t c, double* mean, double* sq){
+    if(a->min == a->max){
+        double q = (double)(a->min / c);
+        *mean = q;
+        *sq = q * q;
+        return;
+    }
+    double m = a->mean / (double)c;
+    double v = a->variance / ((double)c * (double)c);
+    // The rounding always goes the same way if the quotient's sign is
+    // fixed.
+    if(a->min >= 0 || a->max <= 0){
+        double abs_c = fabs((double)c);
+        double sign = (a->min >= 0) == (c > 0)? 1 : -1;
+        m -= sign * (abs_c - 1) / (2 * abs_c);
+        v -= (abs_c * abs_c - 1) / (12 * abs_c * abs_c);
+    }
+    *mean = m;
+    *sq = (v < 0? 0 : v) + m * m;
+}
+
+//
+// Estimates a / b (rounded towards zero, and 0 for a zero divisor).
+//
+// If the divisor is uniform (see dicedist_is_uniform), this averages
+// dividing by each of its values, which only needs a correction for the
+// rounding. Otherwise it is the second order expansion of a ratio of
+// independent variables, which needs a divisor that is kept away from zero;
+// if it isn't, the variance is just the largest the range allows. The
+// range is exact either way.
+//
+static
+DiceMoments
+dicedist_divide_estimate(const DiceMoments* a, const DiceMoments* b, bool b_uniform){
+    // Quotients are extreme at the ends of the dividend and at the ends of
+    // the divisor or its smallest non-zero values.
+    int64_t divisors[4] = {b->min, b->max};
+    int ndivisors = 2;
+    bool zero = b->min <= 0 && b->max >= 0;
+    if(b->min <= -1 && b->max >= -1) divisors[ndivisors++] = -1;
+    if(b->min <= 1 && b->max >= 1) divisors[ndivisors++] = 1;
+    int64_t lo = 0, hi = 0;
+    bool first = !zero;
+    for(int i = 0; i < ndivisors; i++){
+        int64_t y = divisors[i];
+        if(!y) continue;
+        int64_t q[2] = {a->min / y, a->max / y};
+        for(int j = 0; j < 2; j++){
+            if(first || q[j] < lo) lo = q[j];
+            if(first || q[j] > hi) hi = q[j];
+            first = false;
+        }
+    }
+    double mean = 0, variance = 0;
+    bool estimated = true;
+    if(b_uniform){
+        // At most 65536 values, as dice have 16 bit faces.
+        double sq = 0;
+        for(int64_t y = b->min; y <= b->max; y++){
+            if(!y) continue;
+            double m, s;
+            dicedist_divide_by(a, y, &m, &s);
+            mean += m;
+            sq += s;
+        }
+        double n = dicedist_moments_span(b);
+        mean /= n;
+        variance = sq / n - mean * mean;
+        // Only a constant or dividing by 0 or +-1 doesn't round.
+        estimated = a->estimated || (a->min != a->max && (b->min < -1 || b->max > 1));
+    }
+    else if(!zero){
+        double mb2 = b->mean * b->mean;
+        mean = a->mean / b->mean * (1 + b->variance / mb2);
+        variance = (a->variance + a->mean * a->mean * b->variance / mb2) / mb2;
+    }
+    else {
+        double half = ((double)hi - (double)lo) / 2;
+        variance = half * half;
+    }
+    if(mean < lo) mean = lo;
+    if(mean > hi) mean = hi;
+    return (DiceMoments){
+        .mean = mean,
+        .variance = variance < 0? 0 : variance,
+        .min = lo,
+        .max = hi,
+        .estimated = estimated,
+    };
+}
+
+DICEDIST_API
+void
+dicedist_moments(const DiceParseExprBuffer* buff, int index, DiceMoments* out){
+    const DiceParseExpr* exprs = buff->exprs;
+    DiceParseExpr expr = exprs[index];
+    switch((DiceParseExpressionType)expr.type){
+        case DICEPARSE_NUMBER:
+            *out = (DiceMoments){
+                .mean = expr.primary,
+                .min = expr.primary,
+                .max = expr.primary,
+            };
+            return;
+        case DICEPARSE_DIE:{
+            if(expr.primary == 0 || expr.secondary == 0){
+                *out = (DiceMoments){0};
+                return;
+            }
+            double n = expr.secondary;
+            double m = expr.primary;
+            *out = (DiceMoments){
+                .mean = n * (m + 1) / 2,
+                .variance = n * (m * m - 1) / 12,
+                .min = expr.secondary,
+                .max = (int64_t)expr.secondary * expr.primary,
+            };
+            return;
+        }
+        case DICEPARSE_GROUPING:
+            dicedist_moments(buff, expr.primary, out);
+            return;
+        case DICEPARSE_KEEP:{
+            DiceParseExpr die = exprs[expr.primary];
+            if(!die.primary || !die.secondary || !expr.secondary){
+                *out = (DiceMoments){0};
+                return;
+            }
+            if(expr.secondary >= die.secondary){
+                dicedist_moments(buff, expr.primary, out);
+                return;
+            }
+            // No closed form for order statistics, but the DP only depends
+            // on the pool, so small ones are still cheap to do exactly.
+            double work = (double)die.primary * expr.secondary * die.secondary * ((double)expr.secondary * die.primary + 1);
+            if(work <= DICEDIST_MOMENTS_EXACT_KEEP_WORK){
+                DiceDist dist = {0};
+                if(dicedist_keep(die.primary, die.secondary, expr.secondary, expr.type2 == DICEPARSE_KEEP_LOWEST, &dist) == DICEDIST_NO_ERROR){
+                    dicedist_summarize(&dist, out);
+                    dicedist_destroy(&dist);
+                    return;
+                }
+            }
+            *out = dicedist_keep_estimate(die.primary, die.secondary, expr.secondary, expr.type2 == DICEPARSE_KEEP_LOWEST);
+            return;
+        }
+        case DICEPARSE_CUSTOM:{
+            if(!expr.secondary){
+                *out = (DiceMoments){0};
+                return;
+            }
+            const DiceParseCustomDie* c = &buff->customs[expr.primary];
+            double mean = 0, sq = 0;
+            for(uint32_t i = 0; i < c->count; i++){
+                const DiceParseFace* f = &buff->faces[c->first + i];
+                double p = (double)f->weight / (double)c->total_weight;
+                mean += p * f->value;
+                sq += p * f->value * (double)f->value;
+            }
+            double n = expr.secondary;
+            *out = (DiceMoments){
+                .mean = n * mean,
+                .variance = n * (sq - mean * mean),
+                .min = (int64_t)c->min * expr.secondary,
+                .max = (int64_t)c->max * expr.secondary,
+            };
+            return;
+        }
+        case DICEPARSE_SUCCESS:{
+            DiceParseExpr die = exprs[expr.primary];
+            uint32_t lo, hi;
+            diceparse_success_range(expr, die.primary, &lo, &hi);
+            if(!die.secondary || lo == hi){
+                *out = (DiceMoments){0};
+                return;
+            }
+            double n = die.secondary;
+            double p = (double)(hi - lo) / die.primary;
+            *out = (DiceMoments){
+                .mean = n * p,
+                .variance = n * p * (1 - p),
+                .min = hi - lo == die.primary? die.secondary : 0,
+                .max = die.secondary,
+            };
+            return;
+        }
+        case DICEPARSE_EXPLODE:{
+            DiceParseExpr die = exprs[expr.primary];
+            if(!die.primary || !die.secondary){
+                *out = (DiceMoments){0};
+                return;
+            }
+            if(expr.secondary > die.primary){
+                dicedist_moments(buff, expr.primary, out);
+                return;
+            }
+            // A die is k rolls of `at` or more followed by one below it,
+            // or by any roll once it has exploded the most it can. For a
+            // given k those are independent uniforms, so average their
+            // moments over k. Chains left out by dicedist_explode_limit
+            // are left out here too.
+            double f = die.primary, at = expr.secondary;
+            uint32_t kmax = dicedist_explode_limit(die.primary, expr.secondary);
+            double q = (f - at + 1) / f;
+            double hi_mean = (at + f) / 2, hi_var = ((f - at + 1) * (f - at + 1) - 1) / 12;
+            double lo_mean = at / 2, lo_var = ((at - 1) * (at - 1) - 1) / 12;
+            double any_mean = (f + 1) / 2, any_var = (f * f - 1) / 12;
+            double total = 0, mean = 0, sq = 0, qk = 1;
+            for(uint32_t k = 0; k <= kmax; k++, qk *= q){
+                bool capped = k == DICEPARSE_MAX_EXPLOSIONS;
+                double w = capped? qk : qk * (1 - q);
+                double m = k * hi_mean + (capped? any_mean : lo_mean);
+                double v = k * hi_var + (capped? any_var : lo_var);
+                total += w;
+                mean += w * m;
+                sq += w * (v + m * m);
+            }
+            mean /= total;
+            sq /= total;
+            int64_t max = kmax == DICEPARSE_MAX_EXPLOSIONS
+                ? (int64_t)(kmax + 1) * die.primary
+                : (int64_t)kmax * die.primary + expr.secondary - 1;
+            double n = die.secondary;
+            *out = (DiceMoments){
+                .mean = mean * n,
+                .variance = (sq - mean * mean) * n,
+                .min = die.secondary,
+                .max = max * die.secondary,
+            };
+            return;
+        }
+        case DICEPARSE_UNARY:{
+            DiceMoments a;
+            dicedist_moments(buff, expr.primary, &a);
+            switch((DiceParseUnaryOp)expr.type2){
+                case DICEPARSE_PLUS:
+                    *out = a;
+                    return;
+                case DICEPARSE_NEG:
+                    *out = (DiceMoments){
+                        .mean = -a.mean,
+                        .variance = a.variance,
+                        .min = -a.max,
+                        .max = -a.min,
+                        .estimated = a.estimated,
+                    };
+                    return;
+                case DICEPARSE_NOT:
+                    // Can't be zero, so always false.
+                    if(a.min > 0 || a.max < 0){
+                        *out = (DiceMoments){0};
+                        return;
+                    }
+                    // Can only be zero, so always true.
+                    if(a.min == a.max){
+                        *out = (DiceMoments){.mean = 1, .min = 1, .max = 1};
+                        return;
+                    }
+                    // P(a - 0 == 0).
+                    bool uniform = dicedist_is_uniform(buff, expr.primary);
+                    DiceMoments zero = {0};
+                    double p = dicedist_difference_cdf(&a, uniform, &zero, true, 0)
+                             - dicedist_difference_cdf(&a, uniform, &zero, true, -1);
+                    *out = dicedist_bool(p, a.estimated || !uniform);
+                    return;
+            }
+            unreachable();
+        }
+        case DICEPARSE_BINARY:{
+            DiceMoments a, b;
+            dicedist_moments(buff, expr.primary, &a);
+            dicedist_moments(buff, expr.rhs, &b);
+            bool estimated = a.estimated || b.estimated;
+            switch((DiceParseBinOp)expr.type2){
+                case DICEPARSE_ADD:
+                    *out = (DiceMoments){
+                        .mean = a.mean + b.mean,
+                        .variance = a.variance + b.variance,
+                        .min = a.min + b.min,
+                        .max = a.max + b.max,
+                        .estimated = estimated,
+                    };
+                    return;
+                case DICEPARSE_SUBTRACT:
+                    *out = (DiceMoments){
+                        .mean = a.mean - b.mean,
+                        .variance = a.variance + b.variance,
+                        .min = a.min - b.max,
+                        .max = a.max - b.min,
+                        .estimated = estimated,
+                    };
+                    return;
+                case DICEPARSE_MULTIPLY:{
+                    // The two sides are independent, so
+                    // E[XY] = E[X]E[Y] and E[(XY)^2] = E[X^2]E[Y^2].
+                    double ea2 = a.variance + a.mean * a.mean;
+                    double eb2 = b.variance + b.mean * b.mean;
+                    double mean = a.mean * b.mean;
+                    double variance = ea2 * eb2 - mean * mean;
+                    int64_t corners[4] = {
+                        a.min * b.min, a.min * b.max,
+                        a.max * b.min, a.max * b.max,
+                    };
+                    int64_t lo = corners[0], hi = corners[0];
+                    for(int i = 1; i < 4; i++){
+                        if(corners[i] < lo) lo = corners[i];
+                        if(corners[i] > hi) hi = corners[i];
+                    }
+                    *out = (DiceMoments){
+                        .mean = mean,
+                        .variance = variance < 0? 0 : variance,
+                        .min = lo,
+                        .max = hi,
+                        .estimated = estimated,
+                    };
+                    return;
+                }
+                case DICEPARSE_DIVIDE:
+                    *out = dicedist_divide_estimate(&a, &b, b.min == b.max || dicedist_is_uniform(buff, expr.rhs));
+                    return;
+                case DICEPARSE_EQ:
+                case DICEPARSE_NOT_EQ:
+                case DICEPARSE_LESS:
+                case DICEPARSE_LESS_EQ:
+                case DICEPARSE_GREATER:
+                case DICEPARSE_GREATER_EQ:{
+                    // If the ranges don't overlap, the answer is fixed.
+                    int known = -1;
+                    switch((DiceParseBinOp)expr.type2){
+                        case DICEPARSE_EQ:
+                            if(a.max < b.min || a.min > b.max) known = 0;
+                            break;
+                        case DICEPARSE_NOT_EQ:
+                            if(a.max < b.min || a.min > b.max) known = 1;
+                            break;
+                        case DICEPARSE_LESS:
+                            if(a.max < b.min) known = 1;
+                            else if(a.min >= b.max) known = 0;
+                            break;
+                        case DICEPARSE_LESS_EQ:
+                            if(a.max <= b.min) known = 1;
+                            else if(a.min > b.max) known = 0;
+                            break;
+                        case DICEPARSE_GREATER:
+                            if(a.min > b.max) known = 1;
+                            else if(a.max <= b.min) known = 0;
+                            break;
+                        case DICEPARSE_GREATER_EQ:
+                            if(a.min >= b.max) known = 1;
+                            else if(a.max < b.min) known = 0;
+                            break;
+                        default:
+                            break;
+                    }
+                    if(known >= 0){
+                        *out = (DiceMoments){
+                            .mean = known,
+                            .min = known,
+                            .max = known,
+                        };
+                        return;
+                    }
+                    // Exact for dice and constants. Otherwise a - b is close
+                    // enough to normal.
+                    bool a_uniform = a.min == a.max || dicedist_is_uniform(buff, expr.primary);
+                    bool b_uniform = b.min == b.max || dicedist_is_uniform(buff, expr.rhs);
+                    double below = dicedist_difference_cdf(&a, a_uniform, &b, b_uniform, -1);
+                    double upto = dicedist_difference_cdf(&a, a_uniform, &b, b_uniform, 0);
+                    double p;
+                    switch((DiceParseBinOp)expr.type2){
+                        case DICEPARSE_EQ:         p = upto - below;     break;
+                        case DICEPARSE_NOT_EQ:     p = 1 - upto + below; break;
+                        case DICEPARSE_LESS:       p = below;            break;
+                        case DICEPARSE_LESS_EQ:    p = upto;             break;
+                        case DICEPARSE_GREATER:    p = 1 - upto;         break;
+                        case DICEPARSE_GREATER_EQ: p = 1 - below;        break;
+                        default: unreachable();
+                    }
+                    *out = dicedist_bool(p, estimated || !a_uniform || !b_uniform);
+                    return;
+                }
+            }
+            unreachable();
+        }
+    }
+    unreachable();
+}
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
+
+#endif
@@ -0,0 +1,100 @@
+//
+// Copyright © 2021-2022, David Priver
+//
+#ifndef DICEDIST_H
+#define DICEDIST_H
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "diceparse.h"
+
+#ifndef DICEDIST_API
+#define DICEDIST_API extern
+#endif
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#else
+#ifndef _Null_unspecified
+#define _Null_unspecified
+#endif
+#endif
+
+//
+// The exact probability mass function of a dice expression.
+// probs[i] is the probability of the expression evaluating to min + i.
+//
+typedef struct DiceDist {
+    int64_t min;
+    size_t count;
+    double*_Null_unspecified probs;
+} DiceDist;
+
+typedef enum DiceDistError {
+    DICEDIST_NO_ERROR = 0,
+    // The support (or the work to compute it) is beyond what we are willing
+    // to compute.
+    DICEDIST_TOO_LARGE = 1,
+    DICEDIST_OUT_OF_MEMORY = 2,
+} DiceDistError;
+
+// Largest number of distinct values we will represent.
+enum {DICEDIST_MAX_SUPPORT = 1 << 20};
+
+//
+// Computes the distribution of the expression at `index` by walking the
+// tree. The expression should already be validated.
+// On success, `out` owns its memory and must be freed with
+// `dicedist_destroy`.
+//
+DICEDIST_API
+DiceDistError
+dicedist_compute(const DiceParseExprBuffer* buff, int index, DiceDist* out);
+
+DICEDIST_API
+void
+dicedist_destroy(DiceDist* dist);
+
+//
+// Computes the distribution of the sum of `count` dice with `faces` faces.
+//
+DICEDIST_API
+DiceDistError
+dicedist_pool(uint32_t faces, uint32_t count, DiceDist* out);
+
+//
+// Summary statistics of a dice expression.
+//
+typedef struct DiceMoments {
+    double mean;
+    double variance;
+    int64_t min;
+    int64_t max;
+    // Whether the mean and variance are estimates rather than exact.
+    bool estimated;
+} DiceMoments;
+
+//
+// Computes the moments of the expression at `index` in one bottom-up pass
+// over the tree, each node's from its children's, using closed forms for
+// dice, sums, (independent) products and exploding dice.
+// Division, comparisons, `!` and keeping dice have no closed form, so
+// their mean and variance may be estimates (see `estimated`):
+//   - Comparisons and `!` are exact between single dice and constants and
+//     otherwise use a normal approximation.
+//   - Division averages over the divisor if it is a single die or a
+//     constant and otherwise uses a ratio expansion.
+//   - Kept dice are exact for small pools and otherwise come from
+//     continuous order statistics.
+// No node costs more than a bounded amount of work. This never fails. The
+// expression should already be validated.
+//
+DICEDIST_API
+void
+dicedist_moments(const DiceParseExprBuffer* buff, int index, DiceMoments* out);
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
+
+#endif
@@ -4,91 +4,429 @@
 #ifndef DICEPARSE_C
 #define DICEPARSE_C
 #include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "diceparse.h"
-#include "parse_numbers.h"
 
 #ifdef __clang__
 #pragma clang assume_nonnull begin
 #endif
-static inline void diceparse_skip_spaces(StringView* sv);
 
-static inline char diceparse_peek(StringView* sv);
+//
+// What each character can be to the lexer. Letters are case insensitive.
+//
+typedef enum DiceParseCharClass {
+    DICEPARSE_CHAR_OTHER = 0,
+    DICEPARSE_CHAR_SPACE,
+    DICEPARSE_CHAR_DIGIT,
+    DICEPARSE_CHAR_PLUS,
+    DICEPARSE_CHAR_MINUS,
+    DICEPARSE_CHAR_STAR,
+    DICEPARSE_CHAR_SLASH,
+    DICEPARSE_CHAR_BANG,
+    DICEPARSE_CHAR_LESS,
+    DICEPARSE_CHAR_GREATER,
+    DICEPARSE_CHAR_EQUALS,
+    DICEPARSE_CHAR_OPEN,
+    DICEPARSE_CHAR_CLOSE,
+    DICEPARSE_CHAR_OPEN_BRACE,
+    DICEPARSE_CHAR_CLOSE_BRACE,
+    DICEPARSE_CHAR_COMMA,
+    DICEPARSE_CHAR_COLON,
+    DICEPARSE_CHAR_PERCENT,
+    DICEPARSE_CHAR_D,
+    DICEPARSE_CHAR_F,
+    DICEPARSE_CHAR_H,
+    DICEPARSE_CHAR_K,
+    DICEPARSE_CHAR_L,
+    DICEPARSE_CHAR_S,
+} DiceParseCharClass;
+
+static const uint8_t diceparse_char_classes[256] = {
+    [' ']  = DICEPARSE_CHAR_SPACE,
+    ['\t'] = DICEPARSE_CHAR_SPACE,
+    ['\r'] = DICEPARSE_CHAR_SPACE,
+    ['\n'] = DICEPARSE_CHAR_SPACE,
+    ['0' ... '9'] = DICEPARSE_CHAR_DIGIT,
+    ['+'] = DICEPARSE_CHAR_PLUS,
+    ['-'] = DICEPARSE_CHAR_MINUS,
+    ['*'] = DICEPARSE_CHAR_STAR,
+    ['/'] = DICEPARSE_CHAR_SLASH,
+    ['!'] = DICEPARSE_CHAR_BANG,
+    ['<'] = DICEPARSE_CHAR_LESS,
+    ['>'] = DICEPARSE_CHAR_GREATER,
+    ['='] = DICEPARSE_CHAR_EQUALS,
+    ['('] = DICEPARSE_CHAR_OPEN,
+    [')'] = DICEPARSE_CHAR_CLOSE,
+    ['{'] = DICEPARSE_CHAR_OPEN_BRACE,
+    ['}'] = DICEPARSE_CHAR_CLOSE_BRACE,
+    [','] = DICEPARSE_CHAR_COMMA,
+    [':'] = DICEPARSE_CHAR_COLON,
+    ['%'] = DICEPARSE_CHAR_PERCENT,
+    ['d'] = DICEPARSE_CHAR_D, ['D'] = DICEPARSE_CHAR_D,
+    ['f'] = DICEPARSE_CHAR_F, ['F'] = DICEPARSE_CHAR_F,
+    ['h'] = DICEPARSE_CHAR_H, ['H'] = DICEPARSE_CHAR_H,
+    ['k'] = DICEPARSE_CHAR_K, ['K'] = DICEPARSE_CHAR_K,
+    ['l'] = DICEPARSE_CHAR_L, ['L'] = DICEPARSE_CHAR_L,
+    ['s'] = DICEPARSE_CHAR_S, ['S'] = DICEPARSE_CHAR_S,
+};
+
+//
+// What's left of the input: the rest of the current segment, then the
+// segments after it.
+//
+typedef struct DiceParseInput {
+    size_t length;
+    const char* text;
+    const StringView* next;
+    const StringView* end;
+} DiceParseInput;
+
+static inline void diceparse_next_segment(DiceParseInput* sv);
+
+static inline void diceparse_skip(DiceParseInput* sv, size_t n);
+
+static inline char diceparse_peek_second(DiceParseInput* sv);
 
-static inline void diceparse_advance(StringView* sv);
+static inline void diceparse_skip_spaces(DiceParseInput* sv);
 
-static inline int diceparse_match(StringView* sv, const char* chars);
+static inline DiceParseCharClass diceparse_peek(DiceParseInput* sv);
+
+static inline void diceparse_advance(DiceParseInput* sv);
+
+static inline bool diceparse_match(DiceParseInput* sv, DiceParseCharClass c);
 
 static inline int diceparse_expralloc(DiceParseExprBuffer* buff);
 
-static inline int diceparse_parse_comparison(DiceParseExprBuffer*, StringView*);
-static inline int diceparse_parse_addplus(DiceParseExprBuffer*, StringView*);
-static inline int diceparse_parse_muldiv(DiceParseExprBuffer*, StringView*);
-static inline int diceparse_parse_unary(DiceParseExprBuffer*, StringView*);
-static inline int diceparse_parse_terminal(DiceParseExprBuffer*, StringView*);
+static inline int diceparse_push(DiceParseExprBuffer* buff, uint32_t* top, DiceParsePending p);
+static inline int diceparse_match_binop(DiceParseInput* sv, DiceParseBinOp* op);
+static inline int diceparse_precedence(DiceParseBinOp op);
+static inline int diceparse_parse_terminal(DiceParseExprBuffer*, DiceParseInput*);
 
 static inline int diceparse_make_number(DiceParseExprBuffer* buff, int n);
 static inline int diceparse_make_die(DiceParseExprBuffer* buff, int n, int base);
 static inline int diceparse_make_binary(DiceParseExprBuffer* buff, DiceParseBinOp op, int lhs, int rhs);
+static inline int diceparse_parse_suffix(DiceParseExprBuffer* buff, DiceParseInput* sv, int die);
+static inline int diceparse_parse_number(DiceParseInput* sv, uint64_t* out);
+static inline int diceparse_parse_custom(DiceParseExprBuffer* buff, DiceParseInput* sv, int n);
+static inline int diceparse_make_fate(DiceParseExprBuffer* buff, int n);
+static inline int diceparse_make_custom(DiceParseExprBuffer* buff, int n, int first);
 
 
 static inline
 void
-diceparse_skip_spaces(StringView* sv){
-    for(;sv->length; sv->text++, sv->length--){
-        switch(*sv->text){
-            case ' ':
-            case '\t':
-            case '\r':
-            case '\n':
-                continue;
-            default:
+diceparse_skip_spaces(DiceParseInput* sv){
+    // Usually there's no space or just the one, so check before going wide.
+    // Each time around finishes off a segment.
+    while(diceparse_peek(sv) == DICEPARSE_CHAR_SPACE){
+#ifdef __SSE2__
+        while(sv->length >= 16){
+            __m128i v = _mm_loadu_si128((const __m128i*)sv->text);
+            __m128i space = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+                _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))));
+            unsigned other = ~(unsigned)_mm_movemask_epi8(space) & 0xffff;
+            if(other){
+                diceparse_skip(sv, __builtin_ctz(other));
                 return;
+            }
+            diceparse_skip(sv, 16);
         }
+#endif
+        while(sv->length && diceparse_char_classes[(uint8_t)sv->text[0]] == DICEPARSE_CHAR_SPACE)
+            diceparse_advance(sv);
     }
 }
 
+// DICEPARSE_CHAR_OTHER at the end.
 static inline
-char
-diceparse_peek(StringView* sv){
-    return sv->length? sv->text[0]: 0;
+DiceParseCharClass
+diceparse_peek(DiceParseInput* sv){
+    if(!sv->length){
+        diceparse_next_segment(sv);
+        if(!sv->length)
+            return DICEPARSE_CHAR_OTHER;
+    }
+    return diceparse_char_classes[(uint8_t)sv->text[0]];
 }
 
 
+// Only after a peek, which moves on to the next segment if need be.
 static inline
 void
-diceparse_advance(StringView* sv){
+diceparse_advance(DiceParseInput* sv){
     sv->text++;
     sv->length--;
 }
 
+// Skips n chars, which must all be in the current segment.
 static inline
+void
+diceparse_skip(DiceParseInput* sv, size_t n){
+    sv->text += n;
+    sv->length -= n;
+}
+
+static inline
+void
+diceparse_next_segment(DiceParseInput* sv){
+    while(!sv->length && sv->next != sv->end){
+        sv->text = sv->next->text;
+        sv->length = sv->next->length;
+        sv->next++;
+    }
+}
+
+// The char after the next one, or 0 at the end.
+static inline
+char
+diceparse_peek_second(DiceParseInput* sv){
+    if(sv->length > 1)
+        return sv->text[1];
+    for(const StringView* seg = sv->next; seg != sv->end; seg++)
+        if(seg->length)
+            return seg->text[0];
+    return 0;
+}
+
+static inline
+bool
+diceparse_match(DiceParseInput* sv, DiceParseCharClass c){
+    if(diceparse_peek(sv) != c)
+        return false;
+    diceparse_advance(sv);
+    return true;
+}
+
+static
 int
-diceparse_match(StringView* sv, const char* chars){
-    char c = diceparse_peek(sv);
-    for(;*chars;chars++){
-        if(*chars == c) {
-            diceparse_advance(sv);
-            return c;
-        }
+diceparse_grow(DiceParseExprBuffer* buff){
+    if(!buff->capacity){
+        buff->exprs = buff->inline_exprs;
+        buff->capacity = DICEPARSE_INLINE_EXPRS;
+        return 0;
+    }
+    if(buff->capacity >= DICEPARSE_MAX_EXPRS) return -1;
+    uint32_t capacity = buff->capacity * 2;
+    DiceParseExpr* exprs;
+    if(buff->exprs == buff->inline_exprs){
+        exprs = malloc(capacity * sizeof(*exprs));
+        if(!exprs) return -1;
+        memcpy(exprs, buff->inline_exprs, sizeof(buff->inline_exprs));
     }
+    else {
+        exprs = realloc(buff->exprs, capacity * sizeof(*exprs));
+        if(!exprs) return -1;
+    }
+    buff->exprs = exprs;
+    buff->capacity = capacity;
     return 0;
 }
 
 static inline
 int
 diceparse_expralloc(DiceParseExprBuffer* buff){
-    if(buff->cursor >= 1024) return -1;
-    return buff->cursor++;
+    if(buff->cursor >= buff->capacity && diceparse_grow(buff))
+        return -1;
+    return (int)buff->cursor++;
 }
 
+static inline
+int
+diceparse_push(DiceParseExprBuffer* buff, uint32_t* top, DiceParsePending p){
+    if(!buff->pending_capacity){
+        buff->pending = buff->inline_pending;
+        buff->pending_capacity = DICEPARSE_INLINE_PENDING;
+    }
+    if(*top >= buff->pending_capacity){
+        // There is at most one pending operator per node.
+        if(buff->pending_capacity >= DICEPARSE_MAX_EXPRS) return -1;
+        uint32_t capacity = buff->pending_capacity * 2;
+        DiceParsePending* pending;
+        if(buff->pending == buff->inline_pending){
+            pending = malloc(capacity * sizeof(*pending));
+            if(!pending) return -1;
+            memcpy(pending, buff->inline_pending, sizeof(buff->inline_pending));
+        }
+        else {
+            pending = realloc(buff->pending, capacity * sizeof(*pending));
+            if(!pending) return -1;
+        }
+        buff->pending = pending;
+        buff->pending_capacity = capacity;
+    }
+    buff->pending[(*top)++] = p;
+    return 0;
+}
+
+//
+// Matches a binary operator. Returns 1 if there is one, 0 if there isn't
+// and -1 for a `!` that isn't `!=`.
+//
+static inline
+int
+diceparse_match_binop(DiceParseInput* sv, DiceParseBinOp* op){
+    DiceParseCharClass c = diceparse_peek(sv);
+    switch(c){
+        case DICEPARSE_CHAR_STAR:    *op = DICEPARSE_MULTIPLY; break;
+        case DICEPARSE_CHAR_SLASH:   *op = DICEPARSE_DIVIDE;   break;
+        case DICEPARSE_CHAR_PLUS:    *op = DICEPARSE_ADD;      break;
+        case DICEPARSE_CHAR_MINUS:   *op = DICEPARSE_SUBTRACT; break;
+        case DICEPARSE_CHAR_BANG:    *op = DICEPARSE_NOT_EQ;   break;
+        case DICEPARSE_CHAR_EQUALS:  *op = DICEPARSE_EQ;       break;
+        case DICEPARSE_CHAR_LESS:    *op = DICEPARSE_LESS;     break;
+        case DICEPARSE_CHAR_GREATER: *op = DICEPARSE_GREATER;  break;
+        default: return 0;
+    }
+    diceparse_advance(sv);
+    switch(c){
+        case DICEPARSE_CHAR_BANG:
+            if(!diceparse_match(sv, DICEPARSE_CHAR_EQUALS)) return -1;
+            break;
+        case DICEPARSE_CHAR_EQUALS:
+            diceparse_match(sv, DICEPARSE_CHAR_EQUALS);
+            break;
+        case DICEPARSE_CHAR_LESS:
+            if(diceparse_match(sv, DICEPARSE_CHAR_EQUALS)) *op = DICEPARSE_LESS_EQ;
+            break;
+        case DICEPARSE_CHAR_GREATER:
+            if(diceparse_match(sv, DICEPARSE_CHAR_EQUALS)) *op = DICEPARSE_GREATER_EQ;
+            break;
+        default:
+            break;
+    }
+    return 1;
+}
+
+// All binary operators are left associative.
+static inline
+int
+diceparse_precedence(DiceParseBinOp op){
+    switch(op){
+        case DICEPARSE_MULTIPLY:
+        case DICEPARSE_DIVIDE:
+            return 3;
+        case DICEPARSE_ADD:
+        case DICEPARSE_SUBTRACT:
+            return 2;
+        default:
+            return 1;
+    }
+}
+
+//
+// Precedence climbing with an explicit stack of pending operators, so
+// nesting is only limited by memory. Unary and grouping nodes are allocated
+// when their operator is seen and binary nodes once their rhs is done,
+// which is the order recursive descent would allocate them in.
+//
 DICEPARSE_API
 int
 diceparse_parse(DiceParseExprBuffer* buff, StringView sv){
-    int index = diceparse_parse_comparison(buff, &sv);
-    if(index < 0) return index;
-    diceparse_skip_spaces(&sv);
-    if(sv.length != 0) return -1;
-    return index;
+    return diceparse_parse_segments(buff, &sv, 1);
+}
+
+DICEPARSE_API
+int
+diceparse_parse_segments(DiceParseExprBuffer* buff, const StringView* segments, size_t count){
+    DiceParseInput sv = {
+        .length = 0,
+        .text = "",
+        .next = segments,
+        .end = segments + count,
+    };
+    buff->cursor = 0;
+    buff->custom_count = 0;
+    buff->face_count = 0;
+    uint32_t top = 0;
+    for(;;){
+        // Expecting an operand: any prefix operators or open parens, then
+        // a terminal.
+        diceparse_skip_spaces(&sv);
+        DiceParseCharClass c = diceparse_peek(&sv);
+        if(c == DICEPARSE_CHAR_PLUS || c == DICEPARSE_CHAR_BANG || c == DICEPARSE_CHAR_MINUS || c == DICEPARSE_CHAR_OPEN){
+            diceparse_advance(&sv);
+            int node = diceparse_expralloc(buff);
+            if(node < 0) return node;
+            DiceParseExpr* e = &buff->exprs[node];
+            DiceParsePending p = {.index = node};
+            switch(c){
+                case DICEPARSE_CHAR_PLUS:  e->type2 = DICEPARSE_PLUS; break;
+                case DICEPARSE_CHAR_BANG:  e->type2 = DICEPARSE_NOT;  break;
+                case DICEPARSE_CHAR_MINUS: e->type2 = DICEPARSE_NEG;  break;
+                default: break;
+            }
+            if(c == DICEPARSE_CHAR_OPEN){
+                e->type = DICEPARSE_GROUPING;
+                p.kind = DICEPARSE_PENDING_GROUPING;
+            }
+            else {
+                e->type = DICEPARSE_UNARY;
+                p.kind = DICEPARSE_PENDING_UNARY;
+            }
+            if(diceparse_push(buff, &top, p)) return -1;
+            continue;
+        }
+        int index = diceparse_parse_terminal(buff, &sv);
+        if(index < 0) return index;
+        // Have an operand. Finish everything it completes until there's
+        // another binary operator.
+        for(;;){
+            DiceParsePending* pending = buff->pending;
+            while(top && pending[top-1].kind == DICEPARSE_PENDING_UNARY){
+                uint32_t node = pending[--top].index;
+                buff->exprs[node].primary = index;
+                index = node;
+            }
+            diceparse_skip_spaces(&sv);
+            DiceParseBinOp op = DICEPARSE_ADD;
+            int found = diceparse_match_binop(&sv, &op);
+            if(found < 0) return -1;
+            int prec = found? diceparse_precedence(op) : 0;
+            while(top && pending[top-1].kind == DICEPARSE_PENDING_BINARY && diceparse_precedence(pending[top-1].op) >= prec){
+                top--;
+                index = diceparse_make_binary(buff, pending[top].op, pending[top].index, index);
+                if(index < 0) return index;
+            }
+            if(found){
+                if(diceparse_push(buff, &top, (DiceParsePending){
+                    .kind = DICEPARSE_PENDING_BINARY,
+                    .op = op,
+                    .index = index,
+                })) return -1;
+                break;
+            }
+            if(!top){
+                // Spaces were just skipped, so this is past the last
+                // segment if there's nothing left.
+                if(sv.length != 0) return -1;
+                return index;
+            }
+            // Only an open paren can be left on top.
+            if(!diceparse_match(&sv, DICEPARSE_CHAR_CLOSE)) return -1;
+            uint32_t node = pending[--top].index;
+            buff->exprs[node].primary = index;
+            index = node;
+        }
+    }
+}
+
+DICEPARSE_API
+void
+diceparse_destroy(DiceParseExprBuffer* buff){
+    if(buff->exprs != buff->inline_exprs)
+        free(buff->exprs);
+    if(buff->pending != buff->inline_pending)
+        free(buff->pending);
+    buff->exprs = NULL;
+    buff->cursor = 0;
+    buff->capacity = 0;
+    buff->pending = NULL;
+    buff->pending_capacity = 0;
 }
 
 static inline
@@ -124,188 +462,305 @@ diceparse_make_binary(DiceParseExprBuffer* buff, DiceParseBinOp op, int lhs, int
     e->type = DICEPARSE_BINARY;
     e->type2 = op;
     e->primary = lhs;
-    e->secondary = rhs;
+    e->rhs = rhs;
     return result;
 }
 
 
 static inline
 int
-diceparse_parse_comparison(DiceParseExprBuffer* buff, StringView* sv){
-    diceparse_skip_spaces(sv);
-    int lhs = diceparse_parse_addplus(buff, sv);
-    if(lhs < 0) return lhs;
-    diceparse_skip_spaces(sv);
-    char c;
-    while((c = diceparse_match(sv, "!<>="))){
-        char c2;
-        c2 = diceparse_match(sv, "=");
-        if(c == '!'){
-            if(!c2) return -1;
-        }
-        int rhs = diceparse_parse_addplus(buff, sv);
-        if(rhs < 0) return rhs;
-        DiceParseBinOp op;
-        switch(c){
-            case '=': op = DICEPARSE_EQ;                                break;
-            case '!': op = DICEPARSE_NOT_EQ;                            break;
-            case '<': op = c2? DICEPARSE_LESS_EQ: DICEPARSE_LESS;       break;
-            case '>': op = c2? DICEPARSE_GREATER_EQ: DICEPARSE_GREATER; break;
-            default: return -1;
+diceparse_parse_terminal(DiceParseExprBuffer* buff, DiceParseInput* sv){
+    // Don't skip spaces!
+    // These are all "tight"
+    if(diceparse_match(sv, DICEPARSE_CHAR_D)){
+        switch(diceparse_peek(sv)){
+            case DICEPARSE_CHAR_PERCENT:
+                diceparse_advance(sv);
+                return diceparse_parse_suffix(buff, sv, diceparse_make_die(buff, 1, 100));
+            case DICEPARSE_CHAR_OPEN_BRACE:
+                diceparse_advance(sv);
+                return diceparse_parse_custom(buff, sv, 1);
+            case DICEPARSE_CHAR_F:
+                diceparse_advance(sv);
+                return diceparse_make_fate(buff, 1);
+            default:
+                break;
         }
-        lhs = diceparse_make_binary(buff, op, lhs, rhs);
-        if(lhs < 0) return lhs;
-        diceparse_skip_spaces(sv);
+        uint64_t base;
+        if(diceparse_parse_number(sv, &base)) return -1;
+        if(base > UINT16_MAX) return -1;
+        return diceparse_parse_suffix(buff, sv, diceparse_make_die(buff, 1, (int)base));
+    }
+    uint64_t val;
+    if(diceparse_parse_number(sv, &val)) return -1;
+    if(val > UINT32_MAX) return -1;
+    if(!diceparse_match(sv, DICEPARSE_CHAR_D))
+        return diceparse_make_number(buff, (uint32_t)val);
+    switch(diceparse_peek(sv)){
+        case DICEPARSE_CHAR_PERCENT:
+            diceparse_advance(sv);
+            if(val > UINT16_MAX) return -1;
+            return diceparse_parse_suffix(buff, sv, diceparse_make_die(buff, val, 100));
+        case DICEPARSE_CHAR_OPEN_BRACE:
+            diceparse_advance(sv);
+            if(val > UINT16_MAX) return -1;
+            return diceparse_parse_custom(buff, sv, val);
+        case DICEPARSE_CHAR_F:
+            diceparse_advance(sv);
+            if(val > UINT16_MAX) return -1;
+            return diceparse_make_fate(buff, val);
+        default:
+            break;
     }
-    return lhs;
+    uint64_t base;
+    if(diceparse_parse_number(sv, &base)) return -1;
+    if(base > UINT16_MAX) return -1;
+    if(val > UINT16_MAX) return -1;
+    return diceparse_parse_suffix(buff, sv, diceparse_make_die(buff, val, (int)base));
 }
 
+//
+// Parses the faces of a custom die after the `{`, like `{1,1,2,3,5,8}` or
+// `{1:3, 2:1}` where the number after the colon is the face's weight.
+//
 static inline
 int
-diceparse_parse_addplus(DiceParseExprBuffer* buff, StringView* sv){
-    diceparse_skip_spaces(sv);
-    int lhs = diceparse_parse_muldiv(buff, sv);
-    if(lhs < 0) return lhs;
-    diceparse_skip_spaces(sv);
-    char c;
-    while((c=diceparse_match(sv, "+-"))){
-        int rhs = diceparse_parse_muldiv(buff, sv);
-        if(rhs < 0) return rhs;
-        lhs = diceparse_make_binary(buff, c=='+'?DICEPARSE_ADD:DICEPARSE_SUBTRACT, lhs, rhs);
-        if(lhs < 0) return lhs;
+diceparse_parse_custom(DiceParseExprBuffer* buff, DiceParseInput* sv, int n){
+    int first = buff->face_count;
+    for(;;){
         diceparse_skip_spaces(sv);
+        bool negative = diceparse_match(sv, DICEPARSE_CHAR_MINUS);
+        uint64_t value;
+        if(diceparse_parse_number(sv, &value)) goto fail;
+        if(value > INT32_MAX) goto fail;
+        uint64_t weight = 1;
+        diceparse_skip_spaces(sv);
+        if(diceparse_match(sv, DICEPARSE_CHAR_COLON)){
+            diceparse_skip_spaces(sv);
+            if(diceparse_parse_number(sv, &weight)) goto fail;
+            if(weight > UINT32_MAX) goto fail;
+            diceparse_skip_spaces(sv);
+        }
+        if(buff->face_count >= DICEPARSE_MAX_FACES) goto fail;
+        buff->faces[buff->face_count++] = (DiceParseFace){
+            .value = negative? -(int32_t)value : (int32_t)value,
+            .weight = (uint32_t)weight,
+        };
+        if(diceparse_match(sv, DICEPARSE_CHAR_CLOSE_BRACE))
+            break;
+        if(!diceparse_match(sv, DICEPARSE_CHAR_COMMA)) goto fail;
     }
-    return lhs;
+    return diceparse_make_custom(buff, n, first);
+
+    fail:
+    buff->face_count = first;
+    return -1;
 }
 
+// Fate dice are -1, 0 or +1.
 static inline
 int
-diceparse_parse_muldiv(DiceParseExprBuffer* buff, StringView* sv){
-    diceparse_skip_spaces(sv);
-    int lhs = diceparse_parse_unary(buff, sv);
-    if(lhs < 0) return lhs;
-    diceparse_skip_spaces(sv);
-    char c;
-    while((c = diceparse_match(sv, "*/"))){
-        int rhs = diceparse_parse_unary(buff, sv);
-        if(rhs < 0) return rhs;
-        lhs = diceparse_make_binary(buff, c=='*'?DICEPARSE_MULTIPLY:DICEPARSE_DIVIDE, lhs, rhs);
-        if(lhs < 0) return lhs;
-        diceparse_skip_spaces(sv);
-    }
-    return lhs;
+diceparse_make_fate(DiceParseExprBuffer* buff, int n){
+    int first = buff->face_count;
+    if(first + 3 > DICEPARSE_MAX_FACES) return -1;
+    for(int v = -1; v <= 1; v++)
+        buff->faces[buff->face_count++] = (DiceParseFace){.value = v, .weight = 1};
+    return diceparse_make_custom(buff, n, first);
 }
 
+//
+// Makes a CUSTOM node for n of the die whose faces were just added to the
+// buffer starting at `first`, reusing an identical die if there is one.
+// Otherwise its alias table is built here, once, so rolling it never
+// depends on how skewed the weights are.
+//
 static inline
 int
-diceparse_parse_unary(DiceParseExprBuffer* buff, StringView* sv){
-    diceparse_skip_spaces(sv);
-    char c;
-    if((c = diceparse_match(sv, "+!-"))){
-        int lhs = diceparse_expralloc(buff);
-        if(lhs < 0) return lhs;
-        int rhs = diceparse_parse_unary(buff, sv);
-        if(rhs < 0) return rhs;
-        DiceParseExpr* e = &buff->exprs[lhs];
-        e->type = DICEPARSE_UNARY;
-        switch(c){
-            case '+': e->type2 = DICEPARSE_PLUS; break;
-            case '!': e->type2 = DICEPARSE_NOT;  break;
-            case '-': e->type2 = DICEPARSE_NEG;  break;
+diceparse_make_custom(DiceParseExprBuffer* buff, int n, int first){
+    uint32_t count = buff->face_count - first;
+    DiceParseFace* faces = &buff->faces[first];
+    int custom = -1;
+    for(int i = 0; i < buff->custom_count; i++){
+        const DiceParseCustomDie* c = &buff->customs[i];
+        if(c->count != count) continue;
+        bool same = true;
+        for(uint32_t j = 0; j < count && same; j++)
+            same = buff->faces[c->first+j].value == faces[j].value
+                && buff->faces[c->first+j].weight == faces[j].weight;
+        if(same){
+            custom = i;
+            buff->face_count = first;
+            break;
         }
-        e->primary = rhs;
-        return lhs;
     }
-    return diceparse_parse_terminal(buff, sv);
+    if(custom < 0){
+        uint64_t total = 0;
+        int32_t min = INT32_MAX, max = INT32_MIN;
+        for(uint32_t i = 0; i < count; i++){
+            if(!faces[i].weight) continue;
+            total += faces[i].weight;
+            if(faces[i].value < min) min = faces[i].value;
+            if(faces[i].value > max) max = faces[i].value;
+        }
+        if(!total || buff->custom_count >= DICEPARSE_MAX_CUSTOM){
+            buff->face_count = first;
+            return -1;
+        }
+        // Vose's alias method, in integers so the table is exact up to the
+        // 2^-64 of the thresholds: each face's weight times the number of
+        // faces, against a full slot of `total`.
+        uint64_t scaled[DICEPARSE_MAX_FACES];
+        uint32_t small[DICEPARSE_MAX_FACES];
+        uint32_t large[DICEPARSE_MAX_FACES];
+        uint32_t n_small = 0, n_large = 0;
+        for(uint32_t i = 0; i < count; i++){
+            scaled[i] = (uint64_t)faces[i].weight * count;
+            if(scaled[i] < total)
+                small[n_small++] = i;
+            else
+                large[n_large++] = i;
+        }
+        while(n_small && n_large){
+            uint32_t s = small[--n_small];
+            uint32_t l = large[n_large-1];
+            faces[s].threshold = (uint64_t)(((unsigned __int128)scaled[s] << 64) / total);
+            faces[s].alias = l;
+            scaled[l] -= total - scaled[s];
+            if(scaled[l] < total){
+                n_large--;
+                small[n_small++] = l;
+            }
+        }
+        // Whatever is left is exactly full.
+        while(n_large){
+            uint32_t l = large[--n_large];
+            faces[l].threshold = UINT64_MAX;
+            faces[l].alias = l;
+        }
+        while(n_small){
+            uint32_t s = small[--n_small];
+            faces[s].threshold = UINT64_MAX;
+            faces[s].alias = s;
+        }
+        custom = buff->custom_count++;
+        buff->customs[custom] = (DiceParseCustomDie){
+            .first = first,
+            .count = count,
+            .total_weight = total,
+            .min = min,
+            .max = max,
+        };
+    }
+    int result = diceparse_expralloc(buff);
+    if(result < 0) return result;
+    DiceParseExpr* e = &buff->exprs[result];
+    e->type = DICEPARSE_CUSTOM;
+    e->primary = custom;
+    e->secondary = n;
+    return result;
 }
 
+//
+// Parses a run of digits, accumulating the value as it goes. Returns
+// non-zero if there aren't any or they don't fit.
+//
 static inline
 int
-diceparse_parse_terminal(DiceParseExprBuffer* buff, StringView* sv){
-    diceparse_skip_spaces(sv);
-    if(diceparse_match(sv, "(")){
-        int lhs = diceparse_expralloc(buff);
-        if(lhs < 0) return lhs;
-        int rhs = diceparse_parse_comparison(buff, sv);
-        if(rhs < 0) return rhs;
-        diceparse_skip_spaces(sv);
-        if(!diceparse_match(sv, ")")) return -1;
-        DiceParseExpr* e = &buff->exprs[lhs];
-        e->type = DICEPARSE_GROUPING;
-        e->primary = rhs;
-        return lhs;
-    }
-    // Don't skip spaces!
-    // These are all "tight"
-    if(diceparse_match(sv, "dD")){
-        if(diceparse_match(sv, "%"))
-            return diceparse_make_die(buff, 1, 100);
-        char p = diceparse_peek(sv);
-        if(p < '0' || p > '9')
+diceparse_parse_number(DiceParseInput* sv, uint64_t* out){
+    if(diceparse_peek(sv) != DICEPARSE_CHAR_DIGIT)
+        return -1;
+    uint64_t value = 0;
+    bool overflowed = false;
+    do {
+        unsigned digit = (unsigned)(sv->text[0] - '0');
+        overflowed |= __builtin_mul_overflow(value, 10, &value);
+        overflowed |= __builtin_add_overflow(value, digit, &value);
+        diceparse_advance(sv);
+    } while(diceparse_peek(sv) == DICEPARSE_CHAR_DIGIT);
+    if(overflowed) return -1;
+    *out = value;
+    return 0;
+}
+
+//
+// Parses an optional suffix right after the die at index `die`: one of
+// keep/drop (`kh3`, `kl`, `dh1`, `dl2`, where the count defaults to 1),
+// exploding (`!`, `!>=5`, `!>4`, where the default is the highest face) or
+// counting successes (`s>=7`, `s<3`, `s=6`).
+// Success counting has its own `s` so that a comparison after a pool, like
+// `3d6=10` or `d20>=3d6`, still compares the total.
+//
+static inline
+int
+diceparse_parse_suffix(DiceParseExprBuffer* buff, DiceParseInput* sv, int die){
+    if(die < 0) return die;
+    if(diceparse_match(sv, DICEPARSE_CHAR_S)){
+        DiceParseCharClass cmp = diceparse_peek(sv);
+        if(cmp != DICEPARSE_CHAR_LESS && cmp != DICEPARSE_CHAR_GREATER && cmp != DICEPARSE_CHAR_EQUALS)
             return -1;
-        const char* begin = sv->text;
-        const char* end = begin+1;
         diceparse_advance(sv);
-        for(;;){
-            p = diceparse_peek(sv);
-            if(p < '0' || p > '9')
-                break;
-            end++;
-            diceparse_advance(sv);
+        bool or_equal = diceparse_match(sv, DICEPARSE_CHAR_EQUALS);
+        uint64_t t;
+        if(diceparse_parse_number(sv, &t)) return -1;
+        if(t > UINT16_MAX) return -1;
+        int result = diceparse_expralloc(buff);
+        if(result < 0) return result;
+        DiceParseExpr* e = &buff->exprs[result];
+        e->type = DICEPARSE_SUCCESS;
+        switch(cmp){
+            case DICEPARSE_CHAR_EQUALS:  e->type2 = DICEPARSE_EQ;                                       break;
+            case DICEPARSE_CHAR_LESS:    e->type2 = or_equal? DICEPARSE_LESS_EQ : DICEPARSE_LESS;       break;
+            case DICEPARSE_CHAR_GREATER: e->type2 = or_equal? DICEPARSE_GREATER_EQ : DICEPARSE_GREATER; break;
+            default: break;
         }
-        struct Uint64Result r = parse_uint64(begin, end-begin);
-        if(r.errored) return -1;
-        if(r.result > UINT16_MAX) return -1;
-        return diceparse_make_die(buff, 1, (int)r.result);
+        e->secondary = (uint16_t)t;
+        e->primary = die;
+        return result;
     }
-    char p = diceparse_peek(sv);
-    if(p < '0' || p > '9')
-        return -1;
-    const char* begin = sv->text;
-    const char* end = begin+1;
-    diceparse_advance(sv);
-    for(;;){
-        p = diceparse_peek(sv);
-        if(p < '0' || p > '9')
-            break;
-        end++;
+    // `d6!=3` is d6 != 3, so don't take the `!` if an `=` follows.
+    if(diceparse_peek(sv) == DICEPARSE_CHAR_BANG && diceparse_peek_second(sv) != '='){
         diceparse_advance(sv);
+        uint64_t at = buff->exprs[die].primary;
+        if(diceparse_match(sv, DICEPARSE_CHAR_GREATER)){
+            bool or_equal = diceparse_match(sv, DICEPARSE_CHAR_EQUALS);
+            if(diceparse_parse_number(sv, &at)) return -1;
+            if(!or_equal) at++;
+        }
+        // Everything would explode.
+        if(at < 2) return -1;
+        if(at > UINT16_MAX) return -1;
+        int result = diceparse_expralloc(buff);
+        if(result < 0) return result;
+        DiceParseExpr* e = &buff->exprs[result];
+        e->type = DICEPARSE_EXPLODE;
+        e->secondary = at;
+        e->primary = die;
+        return result;
     }
-    uint32_t val;
-    {
-        struct Uint64Result r = parse_uint64(begin, end-begin);
-        if(r.errored) return -1;
-        if(r.result > UINT32_MAX) return -1;
-        val = (uint32_t)r.result;
-    }
-    if(!diceparse_match(sv, "dD"))
-        return diceparse_make_number(buff, val);
-    if(diceparse_match(sv, "%")){
-        if(val > UINT16_MAX) return -1;
-        return diceparse_make_die(buff, val, 100);
-    }
-    p = diceparse_peek(sv);
-    if(p < '0' || p > '9')
-        return -1;
-    begin = sv->text;
-    end = begin+1;
+    DiceParseCharClass c = diceparse_peek(sv);
+    if(c != DICEPARSE_CHAR_K && c != DICEPARSE_CHAR_D) return die;
     diceparse_advance(sv);
-    for(;;){
-        p = diceparse_peek(sv);
-        if(p < '0' || p > '9')
-            break;
-        end++;
-        diceparse_advance(sv);
-    }
-    int val2;
-    {
-        struct Uint64Result r = parse_uint64(begin, end-begin);
-        if(r.errored) return -1;
-        if(r.result > UINT16_MAX) return -1;
-        val2 = r.result;
+    DiceParseCharClass which = diceparse_peek(sv);
+    if(which != DICEPARSE_CHAR_H && which != DICEPARSE_CHAR_L) return -1;
+    diceparse_advance(sv);
+    bool keep = c == DICEPARSE_CHAR_K;
+    bool high = which == DICEPARSE_CHAR_H;
+    uint64_t n = 1;
+    if(diceparse_peek(sv) == DICEPARSE_CHAR_DIGIT){
+        if(diceparse_parse_number(sv, &n)) return -1;
+        if(n > UINT16_MAX) return -1;
     }
-    if(val > UINT16_MAX) return -1;
-    return diceparse_make_die(buff, val, val2);
+    uint64_t count = buff->exprs[die].secondary;
+    if(n > count) n = count;
+    int result = diceparse_expralloc(buff);
+    if(result < 0) return result;
+    DiceParseExpr* e = &buff->exprs[result];
+    e->type = DICEPARSE_KEEP;
+    // Keeping the highest n and dropping the lowest count-n are the same.
+    e->type2 = keep == high? DICEPARSE_KEEP_HIGHEST : DICEPARSE_KEEP_LOWEST;
+    e->secondary = keep? n : count - n;
+    e->primary = die;
+    return result;
 }
 
 #ifdef __clang__
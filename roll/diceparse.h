@@ -12,6 +12,10 @@
 
 #ifdef __clang__
 #pragma clang assume_nonnull begin
+#else
+#ifndef _Null_unspecified
+#define _Null_unspecified
+#endif
 #endif
 
 typedef struct DiceParseExpr {
@@ -19,9 +23,12 @@ typedef struct DiceParseExpr {
     uint8_t type;
     // For BINARY, this is primary BinOp
     // For UNARY, the UnaryOp
+    // For KEEP, the KeepOp
     uint8_t type2;
-    // For DIE, this is the number of dice.
-    // For BINARY, this is the index of the rhs.
+    // For DIE and CUSTOM, this is the number of dice.
+    // For KEEP, the number of dice kept (at most the number rolled).
+    // For EXPLODE, the lowest face that explodes (at least 2).
+    // For SUCCESS, the number each die is compared against.
     uint16_t secondary;
     // For NUMBER, this is the value of the expression
     // For DIE, this is the base of the dice.
@@ -29,13 +36,94 @@ typedef struct DiceParseExpr {
     // For BINARY, the index of the lhs expression
     // For GROUPING, the index of the expression
     // For UNARY, the index of the expression the op is applied to
+    // For KEEP, EXPLODE and SUCCESS, the index of the DIE
+    // For CUSTOM, the index into the buffer's customs.
     uint32_t primary;
+    // For BINARY, the index of the rhs expression
+    uint32_t rhs;
 } DiceParseExpr;
-_Static_assert(sizeof(struct DiceParseExpr) == 8, "");
+_Static_assert(sizeof(struct DiceParseExpr) == 12, "");
+
+enum {
+    // Most distinct custom dice, and faces across all of them, in a buffer.
+    DICEPARSE_MAX_CUSTOM = 64,
+    DICEPARSE_MAX_FACES = 1024,
+    // Nodes, and pending operators, a buffer holds before it has to go to
+    // the heap. Enough for anything typed at a prompt or on the command line.
+    DICEPARSE_INLINE_EXPRS = 64,
+    DICEPARSE_INLINE_PENDING = 32,
+};
+
+//
+// One face of a custom die, along with slot i of the die's alias table:
+// a draw landing in the slot is this face if the fraction drawn is below
+// `threshold`, else face `alias`.
+//
+typedef struct DiceParseFace {
+    int32_t value;
+    uint32_t weight;
+    uint64_t threshold;
+    uint32_t alias;
+    uint32_t _pad;
+} DiceParseFace;
+
+//
+// A die with arbitrary, possibly weighted, faces, from `d{...}` or `dF`.
+//
+typedef struct DiceParseCustomDie {
+    // The die's faces are faces[first] through faces[first+count-1].
+    uint32_t first;
+    uint32_t count;
+    uint64_t total_weight;
+    // Lowest and highest faces that can come up.
+    int32_t min;
+    int32_t max;
+} DiceParseCustomDie;
 
+typedef enum DiceParsePendingKind {
+    DICEPARSE_PENDING_BINARY,
+    DICEPARSE_PENDING_UNARY,
+    DICEPARSE_PENDING_GROUPING,
+} DiceParsePendingKind;
+
+//
+// An operator the parser has seen but whose operands aren't done yet.
+//
+typedef struct DiceParsePending {
+    // This is a DiceParsePendingKind
+    uint8_t kind;
+    // For BINARY, the DiceParseBinOp
+    uint8_t op;
+    // For BINARY, the index of the lhs.
+    // For UNARY and GROUPING, the index of the node, which is allocated
+    // as soon as the operator is seen.
+    uint32_t index;
+} DiceParsePending;
+
+//
+// The nodes of a parsed expression live in `exprs`, which grows as needed
+// and is kept between parses: each diceparse_parse starts over from the
+// beginning of it, so parsing line after line reuses the same memory.
+// The first DICEPARSE_INLINE_EXPRS nodes are stored in the buffer itself,
+// so short expressions don't allocate; this means a buffer mustn't be
+// copied or moved once it has been parsed into.
+// Start with a zeroed buffer and free it with diceparse_destroy.
+//
 typedef struct DiceParseExprBuffer {
-    DiceParseExpr exprs[1024];
-    int cursor;
+    DiceParseExpr*_Null_unspecified exprs;
+    uint32_t cursor;
+    uint32_t capacity;
+    // Side tables for custom dice. Identical dice share an entry.
+    int custom_count;
+    int face_count;
+    DiceParseCustomDie customs[DICEPARSE_MAX_CUSTOM];
+    DiceParseFace faces[DICEPARSE_MAX_FACES];
+    // The parser's stack, kept for the same reason as exprs.
+    DiceParsePending*_Null_unspecified pending;
+    uint32_t pending_capacity;
+    // Where exprs and pending start out.
+    DiceParseExpr inline_exprs[DICEPARSE_INLINE_EXPRS];
+    DiceParsePending inline_pending[DICEPARSE_INLINE_PENDING];
 } DiceParseExprBuffer;
 
 typedef enum DiceParseExpressionType {
@@ -44,8 +132,22 @@ typedef enum DiceParseExpressionType {
     DICEPARSE_BINARY,
     DICEPARSE_GROUPING,
     DICEPARSE_UNARY,
+    // A pool of dice where only the highest or lowest are summed.
+    DICEPARSE_KEEP,
+    // A pool of dice where each die showing at least some face is rolled
+    // again and added, up to DICEPARSE_MAX_EXPLOSIONS times.
+    DICEPARSE_EXPLODE,
+    // The number of dice in a pool that pass a comparison. type2 is the
+    // DiceParseBinOp (EQ or one of the orderings).
+    DICEPARSE_SUCCESS,
+    // A pool of custom dice.
+    DICEPARSE_CUSTOM,
 } DiceParseExpressionType;
 
+// Most times a single exploding die is rolled again, so that a pool takes
+// bounded time (and can't overflow).
+enum {DICEPARSE_MAX_EXPLOSIONS = 100};
+
 typedef enum DiceParseBinOp {
     DICEPARSE_ADD,
     DICEPARSE_SUBTRACT,
@@ -65,10 +167,76 @@ typedef enum DiceParseUnaryOp {
     DICEPARSE_NOT,
 } DiceParseUnaryOp;
 
+// Dropping the highest n is the same as keeping the lowest rest, so `dh`
+// and `dl` are parsed into these.
+typedef enum DiceParseKeepOp {
+    DICEPARSE_KEEP_HIGHEST,
+    DICEPARSE_KEEP_LOWEST,
+} DiceParseKeepOp;
+
+//
+// For SUCCESS, a die succeeds if it shows a face in [*lo, *hi), counting
+// faces from 0.
+//
+static inline
+void
+diceparse_success_range(DiceParseExpr e, uint32_t faces, uint32_t* lo, uint32_t* hi){
+    int64_t t = e.secondary;
+    int64_t l = 0, h = faces;
+    switch((DiceParseBinOp)e.type2){
+        case DICEPARSE_EQ:         l = t - 1; h = t; break;
+        case DICEPARSE_LESS:       h = t - 1;        break;
+        case DICEPARSE_LESS_EQ:    h = t;            break;
+        case DICEPARSE_GREATER:    l = t;            break;
+        case DICEPARSE_GREATER_EQ: l = t - 1;        break;
+        default:                   h = 0;            break;
+    }
+    if(l < 0) l = 0;
+    if(h > faces) h = faces;
+    if(h < l) h = l;
+    *lo = (uint32_t)l;
+    *hi = (uint32_t)h;
+}
+
+//
+// Rolls a custom die given its faces and a random u64. The high half of
+// r*count picks a slot of the alias table and the low half is the fraction
+// compared against its threshold.
+//
+static inline
+int32_t
+diceparse_custom_face(const DiceParseFace* faces, uint32_t count, uint64_t r){
+    unsigned __int128 m = (unsigned __int128)r * count;
+    uint32_t i = (uint32_t)(m >> 64);
+    if((uint64_t)m >= faces[i].threshold)
+        i = faces[i].alias;
+    return faces[i].value;
+}
+
+// Most nodes in one expression. Indices have to fit in an int.
+enum {DICEPARSE_MAX_EXPRS = 0x40000000};
+
+//
+// Parses `sv` into `buff`, replacing whatever was parsed before. Returns the
+// index of the root expression or -1 on error.
+//
 DICEPARSE_API
 int
 diceparse_parse(DiceParseExprBuffer* buff, StringView sv);
 
+//
+// Like diceparse_parse, but the input is the segments one after another,
+// as if they had been joined. Tokens can span segments, so these can be
+// pieces of a read buffer as well as whole words.
+//
+DICEPARSE_API
+int
+diceparse_parse_segments(DiceParseExprBuffer* buff, const StringView* segments, size_t count);
+
+DICEPARSE_API
+void
+diceparse_destroy(DiceParseExprBuffer* buff);
+
 #ifdef __clang__
 #pragma clang assume_nonnull end
 #endif
@@ -0,0 +1,471 @@
+//
+// Copyright © 2021-2022, David Priver
+//
+#ifndef DICEVM_C
+#define DICEVM_C
+#include <stdlib.h>
+#include <stdbool.h>
+#include "dicevm.h"
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#endif
+
+_Static_assert(DICEVM_ADD + DICEPARSE_GREATER_EQ == DICEVM_GREATER_EQ, "");
+_Static_assert(DICEVM_ADD + DICEPARSE_DIVIDE == DICEVM_DIVIDE, "");
+
+static inline int dicevm_emit(DiceVmProgram* prog, DiceVmOpcode op, uint32_t arg);
+static inline int dicevm_emit_die(DiceVmProgram* prog, uint32_t faces, uint32_t count);
+static inline int dicevm_emit_keep(DiceVmProgram* prog, uint32_t faces, uint32_t count, uint32_t keep, bool lowest);
+static inline int dicevm_push_die(DiceVmProgram* prog, DiceVmDie die);
+static inline int dicevm_emit_explode(DiceVmProgram* prog, uint32_t faces, uint32_t count, uint32_t at);
+static inline const DiceVmTable*_Nullable dicevm_get_table(DiceVmProgram* prog, uint32_t faces, uint32_t count);
+static inline const DiceVmAlias*_Nullable dicevm_get_alias(DiceVmProgram* prog, uint32_t faces, uint32_t count);
+
+static inline
+int
+dicevm_emit(DiceVmProgram* prog, DiceVmOpcode op, uint32_t arg){
+    if(prog->count >= prog->capacity){
+        int new_cap = prog->capacity? prog->capacity*2 : 32;
+        DiceVmInstr* new_code = realloc(prog->code, new_cap*sizeof(*new_code));
+        if(!new_code) return -1;
+        prog->code = new_code;
+        prog->capacity = new_cap;
+    }
+    prog->code[prog->count++] = (DiceVmInstr){
+        .op = op,
+        .arg = arg,
+    };
+    return 0;
+}
+
+//
+// Finds or builds the joint-sum table for `count`d`faces`.
+// Returns NULL if the pool is too big for one or we're out of memory, in
+// which case the dice are just rolled.
+//
+static inline
+const DiceVmTable*_Nullable
+dicevm_get_table(DiceVmProgram* prog, uint32_t faces, uint32_t count){
+    if(count < 2)
+        return NULL;
+    uint64_t span = 1;
+    for(uint32_t i = 0; i < count; i++){
+        span *= faces;
+        if(span > UINT32_MAX)
+            return NULL;
+    }
+    uint64_t table_count = (uint64_t)count * (faces - 1) + 1;
+    if(table_count > DICEVM_TABLE_MAX)
+        return NULL;
+    for(int i = 0; i < prog->table_count; i++){
+        DiceVmTable* t = &prog->tables[i];
+        if(t->faces == faces && t->count == count)
+            return t;
+    }
+    if(prog->table_count >= prog->table_capacity){
+        int new_cap = prog->table_capacity? prog->table_capacity*2 : 8;
+        DiceVmTable* new_tables = realloc(prog->tables, new_cap*sizeof(*new_tables));
+        if(!new_tables) return NULL;
+        prog->tables = new_tables;
+        prog->table_capacity = new_cap;
+    }
+    uint32_t* table = malloc(table_count*sizeof(*table));
+    if(!table) return NULL;
+    // Number of ways to roll each total, adding one die at a time, in
+    // place. Each total is at most faces^count, so u32 is enough.
+    // Turning the counts into prefix sums makes each new count a difference
+    // of two entries at or below it, so we can fill from the top down.
+    table[0] = 1;
+    uint32_t n = 1;
+    for(uint32_t d = 0; d < count; d++){
+        for(uint32_t i = 1; i < n; i++)
+            table[i] += table[i-1];
+        uint32_t new_n = n + faces - 1;
+        for(uint32_t i = new_n; i-- > 0;){
+            uint32_t hi = table[i < n? i : n-1];
+            uint32_t lo = 0;
+            if(i >= faces)
+                lo = table[i - faces < n? i - faces : n-1];
+            table[i] = hi - lo;
+        }
+        n = new_n;
+    }
+    for(uint32_t i = 1; i < n; i++)
+        table[i] += table[i-1];
+    DiceVmTable* t = &prog->tables[prog->table_count++];
+    *t = (DiceVmTable){
+        .faces = faces,
+        .count = count,
+        .table_count = (uint32_t)table_count,
+        .table = table,
+    };
+    return t;
+}
+
+//
+// Finds or builds the alias table for a pool, or returns NULL if it
+// doesn't get one (or it couldn't be built, in which case the dice are
+// just rolled).
+//
+static inline
+const DiceVmAlias*_Nullable
+dicevm_get_alias(DiceVmProgram* prog, uint32_t faces, uint32_t count){
+    if(count < 2 || faces < 2)
+        return NULL;
+    uint64_t n = (uint64_t)count * (faces - 1) + 1;
+    if(n > DICEVM_ALIAS_MAX)
+        return NULL;
+    // Each total's ways times n has to fit.
+    unsigned __int128 limit = ~(unsigned __int128)0 / n;
+    unsigned __int128 span = 1;
+    for(uint32_t i = 0; i < count; i++){
+        if(span > limit / faces)
+            return NULL;
+        span *= faces;
+    }
+    for(int i = 0; i < prog->alias_count; i++){
+        DiceVmAlias* a = &prog->aliases[i];
+        if(a->faces == faces && a->count == count)
+            return a;
+    }
+    if(prog->alias_count >= prog->alias_capacity){
+        int new_cap = prog->alias_capacity? prog->alias_capacity*2 : 8;
+        DiceVmAlias* new_aliases = realloc(prog->aliases, new_cap*sizeof(*new_aliases));
+        if(!new_aliases) return NULL;
+        prog->aliases = new_aliases;
+        prog->alias_capacity = new_cap;
+    }
+    DiceVmAliasEntry* entries = malloc(n*sizeof(*entries));
+    // Ways to roll each total, then the under- and overfull worklists.
+    unsigned __int128* ways = malloc(n*sizeof(*ways));
+    uint32_t* work = malloc(n*sizeof(*work));
+    if(!entries || !ways || !work){
+        free(entries);
+        free(ways);
+        free(work);
+        return NULL;
+    }
+    // Same as the joint-sum tables, but in u128.
+    ways[0] = 1;
+    uint64_t m = 1;
+    for(uint32_t d = 0; d < count; d++){
+        for(uint64_t i = 1; i < m; i++)
+            ways[i] += ways[i-1];
+        uint64_t new_m = m + faces - 1;
+        for(uint64_t i = new_m; i-- > 0;){
+            unsigned __int128 hi = ways[i < m? i : m-1];
+            unsigned __int128 lo = 0;
+            if(i >= faces)
+                lo = ways[i - faces < m? i - faces : m-1];
+            ways[i] = hi - lo;
+        }
+        m = new_m;
+    }
+    // Vose's alias method, in integers like custom dice: each total's ways
+    // times n, against a full entry of `span`. Nothing is rounded, so
+    // whatever is left at the end is exactly full.
+    // Small ones grow up from the bottom of `work`, large ones down from
+    // the top.
+    uint64_t n_small = 0, n_large = 0;
+    for(uint64_t i = 0; i < n; i++){
+        ways[i] *= n;
+        if(ways[i] < span)
+            work[n_small++] = (uint32_t)i;
+        else
+            work[n - ++n_large] = (uint32_t)i;
+    }
+    while(n_small && n_large){
+        uint32_t s = work[--n_small];
+        uint32_t l = work[n - n_large];
+        entries[s].threshold = ways[s];
+        entries[s].alias = l;
+        ways[l] -= span - ways[s];
+        if(ways[l] < span){
+            n_large--;
+            work[n_small++] = l;
+        }
+    }
+    while(n_small){
+        uint32_t i = work[--n_small];
+        entries[i].threshold = span;
+        entries[i].alias = i;
+    }
+    while(n_large){
+        uint32_t i = work[n - n_large--];
+        entries[i].threshold = span;
+        entries[i].alias = i;
+    }
+    free(ways);
+    free(work);
+    DiceVmAlias* a = &prog->aliases[prog->alias_count++];
+    *a = (DiceVmAlias){
+        .faces = faces,
+        .count = count,
+        .alias_count = (uint32_t)n,
+        .min = count,
+        .span = span,
+        .entries = entries,
+    };
+    return a;
+}
+
+//
+// Adds a die to the program's table, returning its index or -1.
+//
+static inline
+int
+dicevm_push_die(DiceVmProgram* prog, DiceVmDie die){
+    if(prog->dice_count >= prog->dice_capacity){
+        int new_cap = prog->dice_capacity? prog->dice_capacity*2 : 8;
+        DiceVmDie* new_dice = realloc(prog->dice, new_cap*sizeof(*new_dice));
+        if(!new_dice) return -1;
+        prog->dice = new_dice;
+        prog->dice_capacity = new_cap;
+    }
+    int index = prog->dice_count++;
+    prog->dice[index] = die;
+    return index;
+}
+
+static inline
+int
+dicevm_emit_keep(DiceVmProgram* prog, uint32_t faces, uint32_t count, uint32_t keep, bool lowest){
+    if(!faces || !count || !keep)
+        return dicevm_emit(prog, DICEVM_PUSH, 0);
+    if(faces > prog->histogram_capacity){
+        // Zeroed, as dicevm_roll_keep expects.
+        uint32_t* new_hist = calloc(faces, sizeof(*new_hist));
+        if(!new_hist) return -1;
+        free(prog->histogram);
+        prog->histogram = new_hist;
+        prog->histogram_capacity = faces;
+    }
+    int index = dicevm_push_die(prog, (DiceVmDie){
+        .sampler = bounded_sampler(faces),
+        .radix = mixed_radix_sampler(faces),
+        .count = count,
+        .keep = keep,
+        .keep_lowest = lowest,
+    });
+    if(index < 0) return -1;
+    return dicevm_emit(prog, DICEVM_KEEP, index);
+}
+
+static inline
+int
+dicevm_emit_explode(DiceVmProgram* prog, uint32_t faces, uint32_t count, uint32_t at){
+    // Nothing explodes.
+    if(at > faces)
+        return dicevm_emit_die(prog, faces, count);
+    assert(at >= 2);
+    int index = dicevm_push_die(prog, (DiceVmDie){
+        .sampler = bounded_sampler(faces),
+        .radix = mixed_radix_sampler(faces),
+        .count = count,
+        .explode_at = at,
+        .explode_scale = 1.0 / log((double)(faces - at + 1) / faces),
+        .explode_high = mixed_radix_sampler(faces - at + 1),
+        .explode_low = mixed_radix_sampler(at - 1),
+    });
+    if(index < 0) return -1;
+    return dicevm_emit(prog, DICEVM_EXPLODE, index);
+}
+
+static inline
+int
+dicevm_emit_die(DiceVmProgram* prog, uint32_t faces, uint32_t count){
+    // Degenerate pools are just 0.
+    if(!faces || !count)
+        return dicevm_emit(prog, DICEVM_PUSH, 0);
+    int index = dicevm_push_die(prog, (DiceVmDie){
+        .sampler = bounded_sampler(faces),
+        .radix = mixed_radix_sampler(faces),
+        .count = count,
+    });
+    if(index < 0) return -1;
+    DiceVmDie* die = &prog->dice[index];
+    const DiceVmTable* t = dicevm_get_table(prog, faces, count);
+    if(t){
+        die->sampler = bounded_sampler(t->table[t->table_count-1]);
+        die->table = t->table;
+        die->table_count = t->table_count;
+    }
+    else if(prog->runs >= DICEVM_ALIAS_AFTER){
+        const DiceVmAlias* a = dicevm_get_alias(prog, faces, count);
+        if(a){
+            die->alias = a->entries;
+            die->alias_min = a->min;
+            die->alias_span = a->span;
+            die->alias_count = a->alias_count;
+        }
+    }
+    return dicevm_emit(prog, DICEVM_DIE, index);
+}
+
+DICEVM_API
+int
+dicevm_compile(DiceVmProgram* prog, const DiceParseExprBuffer* buff, int index, uint64_t runs){
+    const DiceParseExpr* exprs = buff->exprs;
+    prog->runs = runs;
+    prog->count = 0;
+    prog->dice_count = 0;
+    prog->face_count = 0;
+    // Explicit work stack so compilation doesn't recurse either.
+    // The low bit marks a node whose children have already been emitted.
+    // Each node is pushed once to be visited and at most once more to be
+    // finished, so twice the nodes is always enough.
+    uint32_t work_needed = 2 * buff->cursor + 1;
+    if(work_needed > prog->work_capacity){
+        uint32_t* new_work = realloc(prog->work, work_needed*sizeof(*new_work));
+        if(!new_work) return -1;
+        prog->work = new_work;
+        prog->work_capacity = work_needed;
+    }
+    uint32_t* work = prog->work;
+    uint32_t top = 0;
+    int depth = 0;
+    int max_depth = 0;
+    work[top++] = (uint32_t)index << 1;
+    while(top){
+        uint32_t item = work[--top];
+        uint32_t idx = item >> 1;
+        bool children_done = item & 1;
+        DiceParseExpr expr = exprs[idx];
+        int err = 0;
+        switch((DiceParseExpressionType)expr.type){
+            case DICEPARSE_NUMBER:
+                err = dicevm_emit(prog, DICEVM_PUSH, expr.primary);
+                depth++;
+                break;
+            case DICEPARSE_DIE:
+                err = dicevm_emit_die(prog, expr.primary, expr.secondary);
+                depth++;
+                break;
+            case DICEPARSE_KEEP:{
+                DiceParseExpr die = exprs[expr.primary];
+                err = dicevm_emit_keep(prog, die.primary, die.secondary, expr.secondary, expr.type2 == DICEPARSE_KEEP_LOWEST);
+                depth++;
+                break;
+            }
+            case DICEPARSE_CUSTOM:{
+                const DiceParseCustomDie* c = &buff->customs[expr.primary];
+                if(!expr.secondary){
+                    err = dicevm_emit(prog, DICEVM_PUSH, 0);
+                    depth++;
+                    break;
+                }
+                if(prog->face_count + c->count > prog->face_capacity){
+                    uint32_t new_cap = prog->face_capacity? prog->face_capacity*2 : 64;
+                    while(new_cap < prog->face_count + c->count) new_cap *= 2;
+                    DiceParseFace* new_faces = realloc(prog->faces, new_cap*sizeof(*new_faces));
+                    if(!new_faces) return -1;
+                    prog->faces = new_faces;
+                    prog->face_capacity = new_cap;
+                }
+                memcpy(prog->faces + prog->face_count, &buff->faces[c->first], c->count*sizeof(*prog->faces));
+                int i = dicevm_push_die(prog, (DiceVmDie){
+                    .count = expr.secondary,
+                    .face_first = prog->face_count,
+                    .face_count = c->count,
+                });
+                prog->face_count += c->count;
+                err = i < 0? -1 : dicevm_emit(prog, DICEVM_CUSTOM, i);
+                depth++;
+                break;
+            }
+            case DICEPARSE_SUCCESS:{
+                DiceParseExpr die = exprs[expr.primary];
+                uint32_t lo, hi;
+                diceparse_success_range(expr, die.primary, &lo, &hi);
+                // Nothing or everything succeeds.
+                if(lo == hi || !die.secondary)
+                    err = dicevm_emit(prog, DICEVM_PUSH, 0);
+                else if(hi - lo == die.primary)
+                    err = dicevm_emit(prog, DICEVM_PUSH, die.secondary);
+                else {
+                    int i = dicevm_push_die(prog, (DiceVmDie){
+                        .radix = mixed_radix_sampler(die.primary),
+                        .count = die.secondary,
+                        .success_lo = lo,
+                        .success_hi = hi,
+                        .binomial = binomial_sampler(die.secondary, (double)(hi - lo) / die.primary),
+                    });
+                    err = i < 0? -1 : dicevm_emit(prog, DICEVM_SUCCESS, i);
+                }
+                depth++;
+                break;
+            }
+            case DICEPARSE_EXPLODE:{
+                DiceParseExpr die = exprs[expr.primary];
+                if(!die.primary || !die.secondary)
+                    err = dicevm_emit(prog, DICEVM_PUSH, 0);
+                else
+                    err = dicevm_emit_explode(prog, die.primary, die.secondary, expr.secondary);
+                depth++;
+                break;
+            }
+            case DICEPARSE_GROUPING:
+                work[top++] = expr.primary << 1;
+                break;
+            case DICEPARSE_BINARY:
+                if(!children_done){
+                    work[top++] = item | 1;
+                    work[top++] = expr.rhs << 1;
+                    work[top++] = expr.primary << 1;
+                    break;
+                }
+                // DiceParseBinOp and the binary opcodes are in the same order.
+                err = dicevm_emit(prog, DICEVM_ADD + expr.type2, 0);
+                depth--;
+                break;
+            case DICEPARSE_UNARY:
+                if(expr.type2 == DICEPARSE_PLUS){
+                    work[top++] = expr.primary << 1;
+                    break;
+                }
+                if(!children_done){
+                    work[top++] = item | 1;
+                    work[top++] = expr.primary << 1;
+                    break;
+                }
+                err = dicevm_emit(prog, expr.type2 == DICEPARSE_NEG? DICEVM_NEG : DICEVM_NOT, 0);
+                break;
+            default:
+                return -1;
+        }
+        if(err) return err;
+        if(depth > max_depth) max_depth = depth;
+    }
+    if(max_depth > prog->stack_capacity){
+        int64_t* new_stack = realloc(prog->stack, max_depth*sizeof(*new_stack));
+        if(!new_stack) return -1;
+        prog->stack = new_stack;
+        prog->stack_capacity = max_depth;
+    }
+    return 0;
+}
+
+DICEVM_API
+void
+dicevm_destroy(DiceVmProgram* prog){
+    free(prog->code);
+    free(prog->dice);
+    free(prog->stack);
+    free(prog->work);
+    free(prog->histogram);
+    free(prog->faces);
+    for(int i = 0; i < prog->table_count; i++)
+        free(prog->tables[i].table);
+    free(prog->tables);
+    for(int i = 0; i < prog->alias_count; i++)
+        free(prog->aliases[i].entries);
+    free(prog->aliases);
+    *prog = (DiceVmProgram){0};
+}
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
+
+#endif
@@ -0,0 +1,530 @@
+//
+// Copyright © 2021-2022, David Priver
+//
+#ifndef DICEVM_H
+#define DICEVM_H
+#include <stdint.h>
+#include <math.h>
+#include "common_macros.h"
+#include "rng.h"
+#include "diceparse.h"
+
+#ifndef DICEVM_API
+#define DICEVM_API extern
+#endif
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#else
+#ifndef _Null_unspecified
+#define _Null_unspecified
+#endif
+#ifndef _Nullable
+#define _Nullable
+#endif
+#endif
+
+//
+// A flat, post-order version of a DiceParseExpr tree.
+//
+// Rolling the tree directly means chasing indices and re-dispatching on
+// the node type at every level. For the non-verbose case we only care
+// about the total, so we compile the tree once into a linear program and
+// run it on a small value stack. Groupings and unary plus vanish during
+// compilation.
+//
+// Dice are rolled in the same order as `roll_and_display`, so for the same
+// rng state both produce the same total, except for pools that are summed
+// without rolling each die (see `dicevm_roll_die`). Otherwise both draw
+// pools of more than one die with a MixedRadixSampler.
+//
+typedef enum DiceVmOpcode {
+    // Push `arg`.
+    DICEVM_PUSH,
+    // Push the sum of the dice described by `dice[arg]`.
+    DICEVM_DIE,
+    // Binary ops. Pop rhs, pop lhs, push the result.
+    DICEVM_ADD,
+    DICEVM_SUBTRACT,
+    DICEVM_MULTIPLY,
+    DICEVM_DIVIDE,
+    DICEVM_EQ,
+    DICEVM_NOT_EQ,
+    DICEVM_LESS,
+    DICEVM_LESS_EQ,
+    DICEVM_GREATER,
+    DICEVM_GREATER_EQ,
+    // Unary ops. Replace the top of the stack.
+    DICEVM_NEG,
+    DICEVM_NOT,
+    // Push the sum of the kept dice of `dice[arg]`.
+    DICEVM_KEEP,
+    // Push the sum of `dice[arg]`, with explosions.
+    DICEVM_EXPLODE,
+    // Push how many of the dice of `dice[arg]` succeed.
+    DICEVM_SUCCESS,
+    // Push the sum of the custom dice of `dice[arg]`.
+    DICEVM_CUSTOM,
+} DiceVmOpcode;
+
+typedef struct DiceVmInstr {
+    // This is a DiceVmOpcode
+    uint8_t op;
+    uint8_t _pad[3];
+    // For PUSH, the value to push.
+    // Otherwise, the index into the program's dice.
+    uint32_t arg;
+} DiceVmInstr;
+_Static_assert(sizeof(struct DiceVmInstr) == 8, "");
+
+typedef struct DiceVmAliasEntry {
+    // Take this entry if a draw below the pool's span is below this, else
+    // `alias`.
+    unsigned __int128 threshold;
+    uint32_t alias;
+} DiceVmAliasEntry;
+
+//
+// Per-node state for a pool of dice, built once at compile time.
+//
+typedef struct DiceVmDie {
+    // The sampler's bound is the number of faces, or faces^count if
+    // `table` is set.
+    BoundedSampler sampler;
+    // For pools of more than one die.
+    MixedRadixSampler radix;
+    // Number of dice in the pool.
+    uint32_t count;
+    // Number of entries in `table`.
+    uint32_t table_count;
+    // If set, table[i] is the number of ways (out of faces^count) to roll
+    // a total of at most count + i.
+    const uint32_t*_Null_unspecified table;
+    // If set, entry i of the alias table is a total of alias_min + i.
+    // A roll picks one of the alias_count entries and then draws below
+    // alias_span (the number of ways to roll the pool) to compare against
+    // its threshold.
+    const DiceVmAliasEntry*_Null_unspecified alias;
+    int64_t alias_min;
+    unsigned __int128 alias_span;
+    uint32_t alias_count;
+    // For KEEP, how many dice are summed and whether they're the lowest.
+    uint32_t keep;
+    uint32_t keep_lowest;
+    // For EXPLODE, the lowest face that explodes, 1/log(chance of
+    // exploding), and samplers for faces that do and don't explode.
+    uint32_t explode_at;
+    double explode_scale;
+    MixedRadixSampler explode_high;
+    MixedRadixSampler explode_low;
+    // For SUCCESS, the faces that succeed are [success_lo, success_hi),
+    // counting from 0, and big pools draw the count from `binomial`.
+    uint32_t success_lo;
+    uint32_t success_hi;
+    BinomialSampler binomial;
+    // For CUSTOM, the die's faces are the program's faces[face_first]
+    // through faces[face_first+face_count-1].
+    uint32_t face_first;
+    uint32_t face_count;
+} DiceVmDie;
+
+//
+// Cumulative joint-sum table for a small pool, shared by every DIE in the
+// program with the same shape and kept between compilations.
+//
+typedef struct DiceVmTable {
+    uint32_t faces;
+    uint32_t count;
+    uint32_t table_count;
+    uint32_t* table;
+} DiceVmTable;
+
+// Pools get a table if faces^count fits in a u32 and the table has at most
+// this many entries.
+enum {DICEVM_TABLE_MAX = 4096};
+
+//
+// Walker/Vose alias table for the total of a pool, shared like the
+// joint-sum tables and kept between compilations. A roll is then two
+// draws and one compare no matter how many dice there are.
+// Pools too big for a joint-sum table get one when the program is compiled
+// to be run at least DICEVM_ALIAS_AFTER times, so whether a pool uses it
+// only depends on the expression and how many times it is rolled.
+// The table is built from the exact number of ways to roll each total, in
+// 128 bit integers, so it is exactly the pool's distribution. That needs
+// the number of ways to roll the pool (its span) times the number of totals
+// to fit in 128 bits, which is up to about 47d6 or 17d100.
+//
+typedef struct DiceVmAlias {
+    uint32_t faces;
+    uint32_t count;
+    uint32_t alias_count;
+    int64_t min;
+    // faces^count.
+    unsigned __int128 span;
+    DiceVmAliasEntry* entries;
+} DiceVmAlias;
+
+enum {
+    DICEVM_ALIAS_AFTER = 1024,
+    // Most totals a pool can have and still get an alias table.
+    DICEVM_ALIAS_MAX = 1 << 16,
+};
+
+typedef struct DiceVmProgram {
+    DiceVmInstr*_Null_unspecified code;
+    int count;
+    int capacity;
+    DiceVmDie*_Null_unspecified dice;
+    int dice_count;
+    int dice_capacity;
+    DiceVmTable*_Null_unspecified tables;
+    int table_count;
+    int table_capacity;
+    DiceVmAlias*_Null_unspecified aliases;
+    int alias_count;
+    int alias_capacity;
+    // How many times the program being compiled will be run.
+    uint64_t runs;
+    // Value stack for `dicevm_run`, sized by the compiler.
+    int64_t*_Null_unspecified stack;
+    int stack_capacity;
+    // Work stack for `dicevm_compile`.
+    uint32_t*_Null_unspecified work;
+    uint32_t work_capacity;
+    // Per-face counts for KEEP, big enough for the most faces of any of
+    // them. All zero between rolls.
+    uint32_t*_Null_unspecified histogram;
+    uint32_t histogram_capacity;
+    // Faces and alias tables of custom dice, copied from the parse buffer.
+    DiceParseFace*_Null_unspecified faces;
+    uint32_t face_count;
+    uint32_t face_capacity;
+} DiceVmProgram;
+
+//
+// Compiles the expression at `index` into `prog`, replacing whatever was
+// there before. Storage is reused between compilations.
+// `runs` is how many times the program will be run in all (across every
+// thread), which decides which pools are worth an alias table. It should
+// not depend on how the runs are split up.
+// Returns non-zero on failure.
+//
+DICEVM_API
+int
+dicevm_compile(DiceVmProgram* prog, const DiceParseExprBuffer* buff, int index, uint64_t runs);
+
+DICEVM_API
+void
+dicevm_destroy(DiceVmProgram* prog);
+
+// Pools at least this big are summed with RngLanes.
+enum {DICEVM_LANES_MIN = 256};
+
+// Success pools needing at most this many mixed-radix draws are rolled
+// rather than drawn from the binomial.
+enum {DICEVM_SUCCESS_ROLLED = 1};
+
+//
+// Sums a pool of dice.
+//
+static inline
+int64_t
+dicevm_roll_die(DiceVmDie* die, RngState* rng){
+    int64_t val = die->count;
+    if(die->alias){
+        uint32_t i = bounded_random(rng, die->alias_count);
+        const DiceVmAliasEntry* e = &die->alias[i];
+        // Full entries don't need the second draw.
+        if(e->threshold != die->alias_span && bounded_random128(rng, die->alias_span) >= e->threshold)
+            i = e->alias;
+        return die->alias_min + i;
+    }
+    if(die->table){
+        // One draw for the whole pool, then find the first total whose
+        // cumulative count exceeds it.
+        uint32_t r = bounded_sampler_draw(&die->sampler, rng);
+        const uint32_t* table = die->table;
+        uint32_t lo = 0, hi = die->table_count - 1;
+        while(lo < hi){
+            uint32_t mid = lo + (hi - lo) / 2;
+            if(table[mid] > r)
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        return val + lo;
+    }
+    if(die->count >= DICEVM_LANES_MIN){
+        // Seeding from the main stream keeps this stateless, which
+        // is cheap next to hundreds of dice.
+        RngLanes lanes;
+        rng_lanes_seed(&lanes, rng);
+        return val + (int64_t)rng_lanes_sum_bounded(&lanes, &die->sampler, die->count);
+    }
+    if(die->count == 1)
+        return val + bounded_sampler_draw(&die->sampler, rng);
+    return val + (int64_t)mixed_radix_sum(&die->radix, rng, die->count);
+}
+
+//
+// Rolls a pool and sums the highest (or lowest) die->keep of them.
+//
+// Faces are counted into the program's histogram and then read back from
+// the top (or bottom) until enough dice are kept, which is O(count + faces)
+// with no sorting. Only the range of faces actually rolled is scanned, and
+// it is cleared on the way.
+//
+static inline
+int64_t
+dicevm_roll_keep(DiceVmProgram* prog, DiceVmDie* die, RngState* rng){
+    uint32_t* hist = prog->histogram;
+    uint32_t lo = UINT32_MAX, hi = 0;
+    if(die->count == 1){
+        uint32_t v = bounded_sampler_draw(&die->sampler, rng);
+        hist[v]++;
+        lo = hi = v;
+    }
+    else {
+        uint32_t vals[MIXED_RADIX_MAX];
+        for(uint32_t i = 0; i < die->count; i += die->radix.per_draw){
+            mixed_radix_draw(&die->radix, rng, vals);
+            uint32_t n = die->count - i;
+            if(n > die->radix.per_draw) n = die->radix.per_draw;
+            for(uint32_t j = 0; j < n; j++){
+                uint32_t v = vals[j];
+                hist[v]++;
+                if(v < lo) lo = v;
+                if(v > hi) hi = v;
+            }
+        }
+    }
+    int64_t sum = 0;
+    uint32_t need = die->keep;
+    if(die->keep_lowest){
+        for(uint32_t v = lo; v <= hi; v++){
+            uint32_t n = hist[v];
+            hist[v] = 0;
+            if(n > need) n = need;
+            need -= n;
+            sum += (int64_t)n * (v + 1);
+        }
+    }
+    else {
+        for(uint32_t v = hi + 1; v-- > lo;){
+            uint32_t n = hist[v];
+            hist[v] = 0;
+            if(n > need) n = need;
+            need -= n;
+            sum += (int64_t)n * (v + 1);
+        }
+    }
+    return sum;
+}
+
+//
+// Rolls a pool of exploding dice.
+//
+// Rather than rolling until a die stops exploding, the number of times each
+// die explodes is drawn directly: it's geometric, so it's floor(log(u) /
+// log(p)) for a uniform u, capped at DICEPARSE_MAX_EXPLOSIONS. Then all the
+// faces that exploded and all the faces that ended a chain are summed in
+// bulk with their own samplers. A die that hit the cap ends on any face.
+// This is O(count) draws for the chains plus one draw per handful of faces,
+// and at most (DICEPARSE_MAX_EXPLOSIONS+1)*count faces however unlucky.
+//
+static inline
+int64_t
+dicevm_roll_explode(DiceVmDie* die, RngState* rng){
+    uint64_t exploded = 0;
+    uint32_t capped = 0;
+    for(uint32_t i = 0; i < die->count; i++){
+        double k = floor(log(rng_uniform_open(rng)) * die->explode_scale);
+        if(k >= DICEPARSE_MAX_EXPLOSIONS){
+            capped++;
+            exploded += DICEPARSE_MAX_EXPLOSIONS;
+        }
+        else
+            exploded += (uint64_t)k;
+    }
+    uint32_t ended = die->count - capped;
+    int64_t sum = (int64_t)exploded * die->explode_at + ended + capped;
+    if(exploded)
+        sum += (int64_t)mixed_radix_sum(&die->explode_high, rng, exploded);
+    if(ended)
+        sum += (int64_t)mixed_radix_sum(&die->explode_low, rng, ended);
+    if(capped)
+        sum += (int64_t)mixed_radix_sum(&die->radix, rng, capped);
+    return sum;
+}
+
+//
+// Counts the dice in a pool that succeed.
+//
+// A pool that fits in a few mixed-radix draws is just rolled, as is every
+// pool if `each` (see dicevm_roll_die_each). Otherwise the count is
+// Binomial(count, p), which is drawn directly in a few draws no matter how
+// big the pool is.
+//
+static inline
+int64_t
+dicevm_roll_success(DiceVmDie* die, RngState* rng, bool each){
+    if(!each && die->count > DICEVM_SUCCESS_ROLLED * die->radix.per_draw)
+        return binomial_sampler_draw(&die->binomial, rng);
+    uint32_t vals[MIXED_RADIX_MAX];
+    int64_t n = 0;
+    for(uint32_t i = 0; i < die->count; i += die->radix.per_draw){
+        mixed_radix_draw(&die->radix, rng, vals);
+        uint32_t take = die->count - i;
+        if(take > die->radix.per_draw) take = die->radix.per_draw;
+        for(uint32_t j = 0; j < take; j++)
+            n += vals[j] - die->success_lo < die->success_hi - die->success_lo;
+    }
+    return n;
+}
+
+//
+// Rolls a pool die by die, the way the verbose walker in roll.c does, for
+// counter-based rngs. Each face then depends only on the seed, the trial,
+// the die and where it is in the pool, however the pool is rolled or
+// shown. Pools of custom dice and kept dice are always rolled like this.
+//
+static inline
+int64_t
+dicevm_roll_die_each(DiceVmDie* die, RngState* rng){
+    if(die->count == 1)
+        return 1 + bounded_random(rng, die->radix.faces);
+    return die->count + (int64_t)mixed_radix_sum(&die->radix, rng, die->count);
+}
+
+static inline
+int64_t
+dicevm_roll_explode_each(const DiceVmDie* die, RngState* rng){
+    uint32_t faces = die->radix.faces;
+    int64_t sum = 0;
+    for(uint32_t i = 0; i < die->count; i++){
+        for(int n = 0; ; n++){
+            uint32_t num = bounded_random(rng, faces) + 1;
+            sum += num;
+            if(num < die->explode_at || n >= DICEPARSE_MAX_EXPLOSIONS)
+                break;
+        }
+    }
+    return sum;
+}
+
+//
+// Sums a pool of custom dice, one u64 and one alias table lookup each.
+//
+static inline
+int64_t
+dicevm_roll_custom(const DiceVmProgram* prog, const DiceVmDie* die, RngState* rng){
+    const DiceParseFace* faces = prog->faces + die->face_first;
+    int64_t sum = 0;
+    for(uint32_t i = 0; i < die->count; i++)
+        sum += diceparse_custom_face(faces, die->face_count, rng_random64(rng));
+    return sum;
+}
+
+//
+// Evaluates a compiled program, returning the total.
+// For Philox, the rng should be at the start of a trial (see
+// rng_philox_seek) and is left at the start of the next one. Its dice are
+// rolled one at a time, so the result is the same as the verbose walker's.
+// Programs cache state as they run, so a program should not be shared
+// between threads.
+//
+static inline
+int64_t
+dicevm_run(DiceVmProgram* prog, RngState* rng){
+    int64_t* sp = prog->stack;
+    const DiceVmInstr* ip = prog->code;
+    const DiceVmInstr* end = ip + prog->count;
+    for(;ip != end; ip++){
+        switch((DiceVmOpcode)ip->op){
+            case DICEVM_PUSH:
+                *sp++ = ip->arg;
+                continue;
+            case DICEVM_DIE:
+                // With a counter-based rng, each die gets its own stream
+                // within the trial, keyed by its index.
+                if(unlikely(rng->engine == RNG_PHILOX)){
+                    rng_philox_seek_die(rng, ip->arg);
+                    *sp++ = dicevm_roll_die_each(&prog->dice[ip->arg], rng);
+                    continue;
+                }
+                *sp++ = dicevm_roll_die(&prog->dice[ip->arg], rng);
+                continue;
+            case DICEVM_KEEP:
+                if(unlikely(rng->engine == RNG_PHILOX))
+                    rng_philox_seek_die(rng, ip->arg);
+                *sp++ = dicevm_roll_keep(prog, &prog->dice[ip->arg], rng);
+                continue;
+            case DICEVM_EXPLODE:
+                if(unlikely(rng->engine == RNG_PHILOX)){
+                    rng_philox_seek_die(rng, ip->arg);
+                    *sp++ = dicevm_roll_explode_each(&prog->dice[ip->arg], rng);
+                    continue;
+                }
+                *sp++ = dicevm_roll_explode(&prog->dice[ip->arg], rng);
+                continue;
+            case DICEVM_SUCCESS:{
+                bool each = rng->engine == RNG_PHILOX;
+                if(unlikely(each))
+                    rng_philox_seek_die(rng, ip->arg);
+                *sp++ = dicevm_roll_success(&prog->dice[ip->arg], rng, each);
+                continue;
+            }
+            case DICEVM_CUSTOM:
+                if(unlikely(rng->engine == RNG_PHILOX))
+                    rng_philox_seek_die(rng, ip->arg);
+                *sp++ = dicevm_roll_custom(prog, &prog->dice[ip->arg], rng);
+                continue;
+            case DICEVM_ADD:
+                sp--; sp[-1] = sp[-1] + sp[0];
+                continue;
+            case DICEVM_SUBTRACT:
+                sp--; sp[-1] = sp[-1] - sp[0];
+                continue;
+            case DICEVM_MULTIPLY:
+                sp--; sp[-1] = sp[-1] * sp[0];
+                continue;
+            case DICEVM_DIVIDE:
+                sp--; sp[-1] = sp[0]? sp[-1] / sp[0] : 0;
+                continue;
+            case DICEVM_EQ:
+                sp--; sp[-1] = sp[-1] == sp[0];
+                continue;
+            case DICEVM_NOT_EQ:
+                sp--; sp[-1] = sp[-1] != sp[0];
+                continue;
+            case DICEVM_LESS:
+                sp--; sp[-1] = sp[-1] < sp[0];
+                continue;
+            case DICEVM_LESS_EQ:
+                sp--; sp[-1] = sp[-1] <= sp[0];
+                continue;
+            case DICEVM_GREATER:
+                sp--; sp[-1] = sp[-1] > sp[0];
+                continue;
+            case DICEVM_GREATER_EQ:
+                sp--; sp[-1] = sp[-1] >= sp[0];
+                continue;
+            case DICEVM_NEG:
+                sp[-1] = -sp[-1];
+                continue;
+            case DICEVM_NOT:
+                sp[-1] = !sp[-1];
+                continue;
+        }
+        unreachable();
+    }
+    rng_next_trial(rng);
+    return sp[-1];
+}
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
+
+#endif
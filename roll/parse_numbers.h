@@ -12,6 +12,19 @@
 // INT64_MAX, etc.
 #include <limits.h>
 
+// The SSE4.1 path is compiled with a target attribute and picked at runtime,
+// like rng.h's kernels, so it doesn't need -msse4.1.
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define PARSE_NUMBERS_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+// Eight digits at a time in a uint64 relies on the first char being the low
+// byte.
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define PARSE_NUMBERS_SWAR 1
+#endif
+
 //
 // Functions for parsing strings into integers.
 //
@@ -170,6 +183,85 @@ parse_unsigned_human(const char* str, size_t length);
 
 // Implementations after this point.
 
+#ifdef PARSE_NUMBERS_SWAR
+//
+// Converts the 8 digits at str. Returns false if they aren't all digits.
+static inline
+bool
+parse_numbers_eight(const char* str, uint64_t* out){
+    uint64_t chunk;
+    __builtin_memcpy(&chunk, str, sizeof chunk);
+    // A digit is 0x30 to 0x39: its high nibble is 3 and stays 3 after
+    // adding 6. Nothing carries between bytes unless a check already failed.
+    bool ok = (chunk & 0xF0F0F0F0F0F0F0F0u) == 0x3030303030303030u
+        && ((chunk + 0x0606060606060606u) & 0xF0F0F0F0F0F0F0F0u) == 0x3030303030303030u;
+    uint64_t d = chunk - 0x3030303030303030u;
+    // Pairs of digits, then fours, then all eight.
+    d = (d * 10 + (d >> 8)) & 0x00FF00FF00FF00FFu;
+    d = (d * 100 + (d >> 16)) & 0x0000FFFF0000FFFFu;
+    d = (d * 10000 + (d >> 32)) & 0xFFFFFFFFu;
+    *out = d;
+    return ok;
+}
+#endif
+
+#ifdef PARSE_NUMBERS_X86_KERNELS
+#define PARSE_NUMBERS_SSE41 __attribute__((target("sse4.1")))
+
+//
+// Converts the 16 digits at str. Returns false if they aren't all digits.
+static
+PARSE_NUMBERS_SSE41
+bool
+parse_numbers_sixteen_sse41(const char* str, uint64_t* out){
+    __m128i d = _mm_sub_epi8(_mm_loadu_si128((const __m128i*)str), _mm_set1_epi8('0'));
+    // Anything that wasn't a digit is now above 9, unsigned.
+    __m128i ok = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+    __m128i pairs = _mm_maddubs_epi16(d, _mm_setr_epi8(10,1,10,1,10,1,10,1,10,1,10,1,10,1,10,1));
+    __m128i fours = _mm_madd_epi16(pairs, _mm_setr_epi16(100,1,100,1,100,1,100,1));
+    __m128i packed = _mm_packus_epi32(fours, fours);
+    __m128i eights = _mm_madd_epi16(packed, _mm_setr_epi16(10000,1,10000,1,10000,1,10000,1));
+    uint64_t hi = (uint32_t)_mm_cvtsi128_si32(eights);
+    uint64_t lo = (uint32_t)_mm_extract_epi32(eights, 1);
+    *out = hi * 100000000u + lo;
+    return _mm_movemask_epi8(ok) == 0xFFFF;
+}
+#endif
+
+//
+// Converts the digits str[0..length), which the callers keep short enough
+// that they can't overflow. Returns false if they aren't all digits.
+static inline
+bool
+parse_numbers_head(const char* str, size_t length, uint64_t* out){
+    bool ok = true;
+    uint64_t value = 0;
+#ifdef PARSE_NUMBERS_X86_KERNELS
+    if(length >= 16 && __builtin_cpu_supports("sse4.1")){
+        ok = parse_numbers_sixteen_sse41(str, &value);
+        str += 16;
+        length -= 16;
+    }
+#endif
+#ifdef PARSE_NUMBERS_SWAR
+    for(; length >= 8; str += 8, length -= 8){
+        uint64_t eight;
+        ok &= parse_numbers_eight(str, &eight);
+        value = value * 100000000u + eight;
+    }
+#endif
+    for(; length; str++, length--){
+        unsigned cval = *str;
+        cval -= '0';
+        if(cval > 9u)
+            ok = false;
+        value *= 10;
+        value += cval;
+    }
+    *out = value;
+    return ok;
+}
+
 static inline
 warn_unused
 struct Uint64Result
@@ -192,16 +284,8 @@ parse_uint64(const char* str, size_t length){
         result.errored = PARSENUMBER_OVERFLOWED_VALUE;
         return result;
     }
-    int bad = false;
-    uint64_t value = 0;
-    for(size_t i=0;i < length-1; i++){
-        unsigned cval = str[i];
-        cval -= '0';
-        if(cval > 9u)
-            bad = true;
-        value *= 10;
-        value += cval;
-    }
+    uint64_t value;
+    bool bad = !parse_numbers_head(str, length-1, &value);
     if(bad){
         result.errored = PARSENUMBER_INVALID_CHARACTER;
         return result;
@@ -256,16 +340,8 @@ parse_int64(const char* str, size_t length){
         result.errored = PARSENUMBER_OVERFLOWED_VALUE;
         return result;
     }
-    int bad = false;
-    uint64_t value = 0;
-    for(size_t i=0;i < length-1; i++){
-        unsigned cval = str[i];
-        cval -= '0';
-        if(cval > 9u)
-            bad = true;
-        value *= 10;
-        value += cval;
-    }
+    uint64_t value;
+    bool bad = !parse_numbers_head(str, length-1, &value);
     if(bad){
         result.errored = PARSENUMBER_INVALID_CHARACTER;
         return result;
@@ -327,16 +403,9 @@ parse_uint32(const char*str, size_t length){
         result.errored = PARSENUMBER_OVERFLOWED_VALUE;
         return result;
     }
-    int bad = false;
-    uint32_t value = 0;
-    for(size_t i=0;i < length-1; i++){
-        unsigned cval = str[i];
-        cval -= '0';
-        if(cval > 9u)
-            bad = true;
-        value *= 10;
-        value += cval;
-    }
+    uint64_t head;
+    bool bad = !parse_numbers_head(str, length-1, &head);
+    uint32_t value = (uint32_t)head;
     if(bad){
         result.errored = PARSENUMBER_INVALID_CHARACTER;
         return result;
@@ -390,16 +459,9 @@ parse_int32(const char*str, size_t length){
         result.errored = PARSENUMBER_OVERFLOWED_VALUE;
         return result;
     }
-    int bad = false;
-    uint32_t value = 0;
-    for(size_t i=0;i < length-1; i++){
-        unsigned cval = str[i];
-        cval -= '0';
-        if(cval > 9u)
-            bad = true;
-        value *= 10;
-        value += cval;
-    }
+    uint64_t head;
+    bool bad = !parse_numbers_head(str, length-1, &head);
+    uint32_t value = (uint32_t)head;
     if(bad){
         result.errored = PARSENUMBER_INVALID_CHARACTER;
         return result;
@@ -30,7 +30,15 @@
 // Modifications by D. Priver are released into the public domain.
 // 
 // seed_rng_auto is original
-// bounded_random was altered to use fast_reduce which gave a nice speed boost
+// bounded_random was altered to use Lemire's multiply and reject, which gave
+// a nice speed boost
+// BoundedSampler is original
+// RngLanes is original
+// The engine switch and RngTrials are original; rng_lcg_jump is from
+// pcg_basic's pcg32_advance_r; pcg64 is PCG XSL RR 128/64, xoshiro256** is from Blackman and Vigna and Philox4x32-10 is from
+// Salmon et al.
+// MixedRadixSampler is original, but is from Brackett-Rozinsky and Lemire's
+// batched ranged random integer generation.
 // Basically everything was renamed.
 //
 
@@ -38,8 +46,12 @@
 #define RNG_H
 // size_t
 #include <stddef.h>
+// memcpy
+#include <string.h>
 // uint64_t, uint32_t
 #include <stdint.h>
+// log, sqrt, floor
+#include <math.h>
 
 #ifdef __linux__
 // for getrandom
@@ -53,43 +65,321 @@
 
 #include <assert.h>
 
+// The vector kernels are compiled with target attributes and picked at
+// runtime (see rng_select_kernels), so they don't need -mavx2 and friends.
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define RNG_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
 #ifdef __clang__
 #pragma clang assume_nonnull begin
+#else
+#ifndef _Null_unspecified
+#define _Null_unspecified
+#endif
 #endif
 
-
-typedef struct RngState {
-    uint64_t state;
-    uint64_t inc;
-} RngState;
+typedef struct RngState RngState;
 
 //
-// Produces a uniform random u32.
+// The generators a RngState can run.
+// PCG32 is the default (and what a zero-initialized RngState is).
 //
+typedef enum RngEngine {
+    // 64 bit LCG, 32 bit output. Smallest state, good quality.
+    RNG_PCG32 = 0,
+    // 128 bit LCG, 64 bit output (PCG XSL RR 128/64), so wide draws need
+    // half as many steps.
+    RNG_PCG64 = 1,
+    // xoshiro256**, 64 bit output. The fastest of these.
+    RNG_XOSHIRO256 = 2,
+    // Philox4x32-10. Counter-based, so any position in the stream can be
+    // jumped to directly, which is what you want for parallel work.
+    // The counter is laid out as (trial, die index, block), so every die of
+    // every trial has its own stream (see rng_philox_seek).
+    RNG_PHILOX = 3,
+    // Not a generator: hands out words made ahead of time on another thread
+    // by a RngPool (see rngpool.h). It can't be seeded or split into
+    // trials, and it is last so it can't be picked by name.
+    RNG_POOL = 4,
+    RNG_ENGINE_COUNT,
+} RngEngine;
+
+struct RngState {
+    // This is a RngEngine.
+    uint32_t engine;
+    union {
+        struct {
+            uint64_t state;
+            uint64_t inc;
+        } pcg32;
+        struct {
+            unsigned __int128 state;
+            unsigned __int128 inc;
+        } pcg64;
+        struct {
+            uint64_t s[4];
+        } xoshiro;
+        struct {
+            // 128 bit block counter. counter[1] is the trial, the high half
+            // of counter[0] is the die index and the low half the block.
+            uint64_t counter[2];
+            uint32_t key[2];
+            // Unused outputs of the last block.
+            uint32_t buff[4];
+            uint32_t avail;
+        } philox;
+        struct {
+            // Unused words of the current buffer.
+            const uint32_t*_Null_unspecified cursor;
+            const uint32_t*_Null_unspecified end;
+            // Gets the next buffer and returns its first word.
+            uint32_t (*_Null_unspecified refill)(RngState* rng);
+            void*_Null_unspecified pool;
+        } pool;
+    };
+};
+
 static inline
 uint32_t
-rng_random32(RngState* rng){
-    uint64_t oldstate = rng->state;
-    rng->state = oldstate * 6364136223846793005ULL + rng->inc;
+rng_pcg32_random32(RngState* rng){
+    uint64_t oldstate = rng->pcg32.state;
+    rng->pcg32.state = oldstate * 6364136223846793005ULL + rng->pcg32.inc;
     uint32_t xorshifted = (uint32_t) ( ((oldstate >> 18u) ^ oldstate) >> 27u);
     uint32_t rot = oldstate >> 59u;
     return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
 }
 
+#define RNG_PCG64_MULT (((unsigned __int128)2549297995355413924ULL << 64) | 4865540595714422341ULL)
+
+static inline
+uint64_t
+rng_pcg64_random64(RngState* rng){
+    unsigned __int128 oldstate = rng->pcg64.state;
+    rng->pcg64.state = oldstate * RNG_PCG64_MULT + rng->pcg64.inc;
+    uint64_t xored = (uint64_t)(oldstate >> 64) ^ (uint64_t)oldstate;
+    unsigned rot = (unsigned)(oldstate >> 122u);
+    return (xored >> rot) | (xored << ((-rot) & 63));
+}
+
+static inline
+uint64_t
+rng_rotl64(uint64_t x, int k){
+    return (x << k) | (x >> (64 - k));
+}
+
+static inline
+uint64_t
+rng_xoshiro256_random64(RngState* rng){
+    uint64_t* s = rng->xoshiro.s;
+    uint64_t result = rng_rotl64(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rng_rotl64(s[3], 45);
+    return result;
+}
 
 //
-// Seeds the rng with the given values.
+// Philox4x32-10 from Salmon et al, "Parallel Random Numbers: As Easy as
+// 1, 2, 3". Encrypts `counter` with `key`, writing four u32s to out.
 //
 static inline
 void
-seed_rng_fixed(RngState* rng, uint64_t initstate, uint64_t initseq){
-    rng->state = 0U;
-    rng->inc = (initseq << 1u) | 1u;
-    rng_random32(rng);
-    rng->state += initstate;
-    rng_random32(rng);
+rng_philox_block(const uint64_t counter[2], const uint32_t key[2], uint32_t out[4]){
+    uint32_t c0 = (uint32_t)counter[0], c1 = (uint32_t)(counter[0] >> 32);
+    uint32_t c2 = (uint32_t)counter[1], c3 = (uint32_t)(counter[1] >> 32);
+    uint32_t k0 = key[0], k1 = key[1];
+    for(int i = 0; i < 10; i++){
+        if(i){
+            k0 += 0x9E3779B9u;
+            k1 += 0xBB67AE85u;
+        }
+        uint64_t p0 = (uint64_t)0xD2511F53u * c0;
+        uint64_t p1 = (uint64_t)0xCD9E8D57u * c2;
+        c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+        c1 = (uint32_t)p1;
+        c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+        c3 = (uint32_t)p0;
+    }
+    out[0] = c0; out[1] = c1; out[2] = c2; out[3] = c3;
+}
+
+static inline
+uint32_t
+rng_philox_random32(RngState* rng){
+    if(!rng->philox.avail){
+        rng_philox_block(rng->philox.counter, rng->philox.key, rng->philox.buff);
+        if(!++rng->philox.counter[0])
+            rng->philox.counter[1]++;
+        rng->philox.avail = 4;
+    }
+    return rng->philox.buff[4 - rng->philox.avail--];
+}
+
+//
+// Moves a Philox rng to the start of the stream for die `die` of trial
+// `trial`, where trial 0 is where seed_rng_fixed left it.
+// Nothing else about where the rng was matters, so any die of any trial
+// can be rolled on its own and in any order.
+//
+static inline
+void
+rng_philox_seek(RngState* rng, const RngState* base, uint64_t trial, uint32_t die){
+    rng->engine = RNG_PHILOX;
+    rng->philox.key[0] = base->philox.key[0];
+    rng->philox.key[1] = base->philox.key[1];
+    rng->philox.counter[1] = base->philox.counter[1] + trial;
+    rng->philox.counter[0] = (uint64_t)die << 32;
+    rng->philox.avail = 0;
+}
+
+//
+// For counter-based engines, moves on to the start of the next trial.
+// The other engines are just one long stream, so this does nothing.
+//
+static inline
+void
+rng_next_trial(RngState* rng){
+    if(unlikely(rng->engine == RNG_PHILOX))
+        rng_philox_seek(rng, rng, 1, 0);
+}
+
+//
+// Same as rng_philox_seek, but staying in the current trial.
+//
+static inline
+void
+rng_philox_seek_die(RngState* rng, uint32_t die){
+    rng->philox.counter[0] = (uint64_t)die << 32;
+    rng->philox.avail = 0;
 }
 
+//
+// Everything but PCG32. Kept out of line so the default engine's path stays
+// small.
+//
+static
+uint32_t
+rng_random32_other(RngState* rng){
+    switch((RngEngine)rng->engine){
+        case RNG_PCG64:
+            return rng_pcg64_random64(rng) >> 32;
+        case RNG_XOSHIRO256:
+            return rng_xoshiro256_random64(rng) >> 32;
+        case RNG_PHILOX:
+            return rng_philox_random32(rng);
+        case RNG_POOL:
+            if(likely(rng->pool.cursor != rng->pool.end))
+                return *rng->pool.cursor++;
+            return rng->pool.refill(rng);
+        case RNG_PCG32:
+        case RNG_ENGINE_COUNT:
+            break;
+    }
+    return rng_pcg32_random32(rng);
+}
+
+//
+// Produces a uniform random u32.
+//
+static inline
+uint32_t
+rng_random32(RngState* rng){
+    if(likely(rng->engine == RNG_PCG32))
+        return rng_pcg32_random32(rng);
+    return rng_random32_other(rng);
+}
+
+
+//
+// Produces a uniform random u64.
+// For the 32 bit engines, this is two outputs, high half first.
+//
+static inline
+uint64_t
+rng_random64(RngState* rng){
+    switch((RngEngine)rng->engine){
+        case RNG_PCG64:
+            return rng_pcg64_random64(rng);
+        case RNG_XOSHIRO256:
+            return rng_xoshiro256_random64(rng);
+        case RNG_PCG32:
+        case RNG_PHILOX:
+        case RNG_POOL:
+        case RNG_ENGINE_COUNT:
+            break;
+    }
+    uint64_t hi = rng_random32(rng);
+    uint64_t lo = rng_random32(rng);
+    return hi << 32 | lo;
+}
+
+static inline
+uint64_t
+rng_splitmix64(uint64_t* x){
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+
+//
+// Seeds the rng with the given values, keeping its engine.
+// initseq selects the stream: different initseqs give independent
+// sequences even for the same initstate.
+//
+static inline
+void
+seed_rng_fixed(RngState* rng, uint64_t initstate, uint64_t initseq){
+    uint32_t engine = rng->engine;
+    *rng = (RngState){.engine = engine};
+    switch((RngEngine)engine){
+        case RNG_PCG32:
+        // Seeding a pool just gives you a PCG32.
+        case RNG_POOL:
+        case RNG_ENGINE_COUNT:
+            rng->engine = RNG_PCG32;
+            rng->pcg32.state = 0U;
+            rng->pcg32.inc = (initseq << 1u) | 1u;
+            rng_pcg32_random32(rng);
+            rng->pcg32.state += initstate;
+            rng_pcg32_random32(rng);
+            return;
+        case RNG_PCG64:{
+            // Widen the seeds the same way for the 128 bit state.
+            uint64_t x = initstate;
+            uint64_t y = initseq;
+            unsigned __int128 state = (unsigned __int128)rng_splitmix64(&x) << 64 | initstate;
+            unsigned __int128 seq = (unsigned __int128)rng_splitmix64(&y) << 64 | initseq;
+            rng->pcg64.state = 0U;
+            rng->pcg64.inc = (seq << 1u) | 1u;
+            rng_pcg64_random64(rng);
+            rng->pcg64.state += state;
+            rng_pcg64_random64(rng);
+            return;
+        }
+        case RNG_XOSHIRO256:{
+            // Seeding with splitmix64 is what the authors recommend. Its
+            // output function is a bijection, so four consecutive outputs
+            // can't all be zero.
+            uint64_t x = initstate ^ rng_splitmix64(&initseq);
+            for(int i = 0; i < 4; i++)
+                rng->xoshiro.s[i] = rng_splitmix64(&x);
+            return;
+        }
+        case RNG_PHILOX:
+            rng->philox.key[0] = (uint32_t)initseq;
+            rng->philox.key[1] = (uint32_t)(initseq >> 32);
+            rng->philox.counter[1] = initstate;
+            return;
+    }
+}
 
 //
 // Seeds the rng using os APIs when available.
@@ -127,6 +417,179 @@ seed_rng_auto(RngState* rng){
     seed_rng_fixed(rng, initstate, initseq);
 }
 
+//
+// Affine map for stepping an LCG `delta` times at once:
+// state -> mult * state + plus, where one step is
+// state -> cur_mult * state + cur_plus.
+// This is Brown's "Random Number Generation with Arbitrary Strides", as in
+// pcg_basic's pcg32_advance, which takes O(log delta) multiplies. The step
+// can itself be a jump, so a jump can be repeated any number of times.
+//
+static inline
+void
+rng_lcg_jump(unsigned __int128 delta, unsigned __int128 cur_mult, unsigned __int128 cur_plus, unsigned __int128* mult, unsigned __int128* plus){
+    unsigned __int128 acc_mult = 1u;
+    unsigned __int128 acc_plus = 0u;
+    while(delta){
+        if(delta & 1){
+            acc_mult *= cur_mult;
+            acc_plus = acc_plus * cur_mult + cur_plus;
+        }
+        cur_plus = (cur_mult + 1) * cur_plus;
+        cur_mult *= cur_mult;
+        delta >>= 1;
+    }
+    *mult = acc_mult;
+    *plus = acc_plus;
+}
+
+//
+// Moves rng forward as if rng_random32 had been called `delta` times.
+// This is O(log delta) for the PCGs and O(1) for Philox. xoshiro256 can
+// only jump by fixed, huge amounts, and a pool can only be read, so those
+// just step.
+//
+static inline
+void
+rng_advance(RngState* rng, uint64_t delta){
+    unsigned __int128 mult, plus;
+    switch((RngEngine)rng->engine){
+        case RNG_PCG32:
+        case RNG_ENGINE_COUNT:
+            rng_lcg_jump(delta, 6364136223846793005ULL, rng->pcg32.inc, &mult, &plus);
+            rng->pcg32.state = (uint64_t)mult * rng->pcg32.state + (uint64_t)plus;
+            return;
+        case RNG_PCG64:
+            rng_lcg_jump(delta, RNG_PCG64_MULT, rng->pcg64.inc, &mult, &plus);
+            rng->pcg64.state = mult * rng->pcg64.state + plus;
+            return;
+        case RNG_PHILOX:{
+            if(delta <= rng->philox.avail){
+                rng->philox.avail -= (uint32_t)delta;
+                return;
+            }
+            delta -= rng->philox.avail;
+            rng->philox.avail = 0;
+            // Blocks carry into the die index and then the trial, as they
+            // would if stepped.
+            uint64_t lo = rng->philox.counter[0];
+            rng->philox.counter[0] = lo + delta / 4;
+            if(rng->philox.counter[0] < lo)
+                rng->philox.counter[1]++;
+            for(delta %= 4; delta; delta--)
+                rng_philox_random32(rng);
+            return;
+        }
+        case RNG_XOSHIRO256:
+        case RNG_POOL:
+            for(; delta; delta--)
+                rng_random32(rng);
+            return;
+    }
+}
+
+//
+// Hands out the rng for each trial of a run, so that trial k gets the same
+// stream no matter which thread asks for it or how the run was split up.
+//
+// Philox gives each trial its own 2^64 blocks of counter.
+// PCG64 trial k starts 2^64 outputs after trial k-1 in the base stream,
+// found with rng_lcg_jump. Its period of 2^128 leaves room for 2^64 trials
+// and no trial can draw anywhere near 2^64 times, so they never overlap.
+// PCG32's period of 2^64 is too short to cut up like that, so it and
+// xoshiro256 seed trial k from the base state and k instead, so each trial
+// is its own stream (for PCG32, with its own increment).
+// Any trial can be started directly either way.
+//
+typedef struct RngTrials {
+    // Start of trial 0.
+    RngState base;
+    // For PCG64, the start of trial `trial`, and one trial's worth of steps
+    // as an affine map of the state.
+    RngState next;
+    unsigned __int128 mult;
+    unsigned __int128 plus;
+    // For PCG32 and xoshiro256, the base state folded down to the seeds
+    // trials are derived from.
+    uint64_t key[2];
+    // The next trial handed out.
+    uint64_t trial;
+} RngTrials;
+
+static inline
+void
+rng_trials_init(RngTrials* trials, const RngState* base){
+    trials->base = *base;
+    trials->next = *base;
+    trials->trial = 0;
+    trials->mult = 1;
+    trials->plus = 0;
+    trials->key[0] = 0;
+    trials->key[1] = 0;
+    assert(base->engine != RNG_POOL);
+    switch((RngEngine)base->engine){
+        case RNG_PCG32:
+        case RNG_POOL:
+        case RNG_ENGINE_COUNT:
+            trials->base.engine = RNG_PCG32;
+            trials->key[0] = base->pcg32.state;
+            trials->key[1] = base->pcg32.inc;
+            break;
+        case RNG_PCG64:
+            rng_lcg_jump((unsigned __int128)1 << 64, RNG_PCG64_MULT, base->pcg64.inc, &trials->mult, &trials->plus);
+            break;
+        case RNG_XOSHIRO256:
+            trials->key[0] = base->xoshiro.s[0] ^ base->xoshiro.s[2];
+            trials->key[1] = base->xoshiro.s[1] ^ base->xoshiro.s[3];
+            break;
+        case RNG_PHILOX:
+            break;
+    }
+}
+
+//
+// Sets rng to the start of trial `trials->trial` and moves on to the next one.
+//
+static inline
+void
+rng_trials_next(RngTrials* trials, RngState* rng){
+    uint64_t trial = trials->trial++;
+    switch((RngEngine)trials->base.engine){
+        case RNG_PHILOX:
+            rng_philox_seek(rng, &trials->base, trial, 0);
+            return;
+        case RNG_PCG64:
+            *rng = trials->next;
+            trials->next.pcg64.state = trials->mult * trials->next.pcg64.state + trials->plus;
+            return;
+        default:
+            break;
+    }
+    uint64_t t = trial;
+    uint64_t initstate = trials->key[0] ^ rng_splitmix64(&t);
+    uint64_t initseq = trials->key[1] ^ rng_splitmix64(&t);
+    rng->engine = trials->base.engine;
+    seed_rng_fixed(rng, initstate, initseq);
+}
+
+//
+// Makes `trial` the next trial handed out, in O(log trial).
+//
+static inline
+void
+rng_trials_seek(RngTrials* trials, uint64_t trial){
+    trials->trial = trial;
+    if(trials->base.engine == RNG_PCG64){
+        unsigned __int128 mult, plus;
+        rng_lcg_jump(trial, trials->mult, trials->plus, &mult, &plus);
+        trials->next.pcg64.state = mult * trials->base.pcg64.state + plus;
+    }
+}
+
+// How many draws in a row the samplers below reject before giving up.
+// A working rng essentially never gets near this; an unseeded one can.
+enum {RNG_MAX_REJECTS = 10000};
+
 // from
 // https://lemire.me/blog/2016/06/27/a-fast-alternative-to-the-modulo-reduction/
 static inline
@@ -139,25 +602,650 @@ fast_reduce(uint32_t x, uint32_t N){
 //
 // Returns a random u32 in the range of [0, bound).
 //
+// This is Lemire's nearly divisionless method: the threshold (which needs a
+// division) is only computed when the low half of the product lands below
+// the bound, which for small bounds almost never happens.
+// https://arxiv.org/abs/1805.10941
+//
 static inline
 uint32_t
 bounded_random(RngState* rng, uint32_t bound){
-    uint32_t threshold = -bound % bound;
+    uint64_t m = (uint64_t)rng_random32(rng) * (uint64_t)bound;
+    uint32_t l = (uint32_t)m;
+    if(unlikely(l < bound)){
+        uint32_t threshold = -bound % bound;
+        // bounded loop to catch unitialized rng errors
+        for(size_t i = 0; l < threshold; i++){
+            if(unlikely(i == RNG_MAX_REJECTS)){
+                // Keep the last draw rather than spinning forever.
+                assert(0);
+                break;
+            }
+            m = (uint64_t)rng_random32(rng) * (uint64_t)bound;
+            l = (uint32_t)m;
+        }
+    }
+    return m >> 32;
+}
+
+//
+// Returns a random u64 in the range of [0, bound), the same way as
+// `bounded_random`.
+//
+static inline
+uint64_t
+bounded_random64(RngState* rng, uint64_t bound){
+    unsigned __int128 m = (unsigned __int128)rng_random64(rng) * bound;
+    uint64_t l = (uint64_t)m;
+    if(unlikely(l < bound)){
+        uint64_t threshold = -bound % bound;
+        for(size_t i = 0; l < threshold; i++){
+            if(unlikely(i == RNG_MAX_REJECTS)){
+                assert(0);
+                break;
+            }
+            m = (unsigned __int128)rng_random64(rng) * bound;
+            l = (uint64_t)m;
+        }
+    }
+    return (uint64_t)(m >> 64);
+}
+
+//
+// Returns a random u128 in the range of [0, bound).
+// Bounds up to 2^64 are done like `bounded_random64`. Bigger ones have no
+// wider product to take the high half of, so the draw is masked down to the
+// bits the bound needs and rejected if it's too big, which happens less
+// than half the time.
+//
+static inline
+unsigned __int128
+bounded_random128(RngState* rng, unsigned __int128 bound){
+    assert(bound);
+    uint64_t hi_bound = (uint64_t)((bound - 1) >> 64);
+    if(!hi_bound){
+        if(bound >> 64)
+            return rng_random64(rng);
+        return bounded_random64(rng, (uint64_t)bound);
+    }
+    uint64_t hi_mask = UINT64_MAX >> __builtin_clzll(hi_bound);
+    unsigned __int128 r = 0;
+    // bounded loop to catch unitialized rng errors
+    for(size_t i = 0; i < RNG_MAX_REJECTS; i++){
+        uint64_t hi = rng_random64(rng) & hi_mask;
+        r = (unsigned __int128)hi << 64 | rng_random64(rng);
+        if(r < bound)
+            return r;
+    }
+    assert(0);
+    return r;
+}
+
+//
+// For drawing from the same bound many times, like all the dice in a pool.
+// Same results as `bounded_random`, but the threshold is computed at most
+// once, the first time it is needed.
+//
+typedef struct BoundedSampler {
+    uint32_t bound;
+    // -bound % bound, or UINT32_MAX if not computed yet.
+    // (The real threshold is always less than bound.)
+    uint32_t threshold;
+} BoundedSampler;
+
+static inline
+BoundedSampler
+bounded_sampler(uint32_t bound){
+    assert(bound);
+    return (BoundedSampler){.bound = bound, .threshold = UINT32_MAX};
+}
+
+//
+// Returns a random u32 in the range of [0, sampler->bound).
+//
+static inline
+force_inline
+uint32_t
+bounded_sampler_draw(BoundedSampler* sampler, RngState* rng){
+    uint32_t bound = sampler->bound;
+    uint64_t m = (uint64_t)rng_random32(rng) * (uint64_t)bound;
+    uint32_t l = (uint32_t)m;
+    if(unlikely(l < bound)){
+        if(sampler->threshold == UINT32_MAX)
+            sampler->threshold = -bound % bound;
+        uint32_t threshold = sampler->threshold;
+        for(size_t i = 0; l < threshold; i++){
+            if(unlikely(i == RNG_MAX_REJECTS)){
+                assert(0);
+                break;
+            }
+            m = (uint64_t)rng_random32(rng) * (uint64_t)bound;
+            l = (uint32_t)m;
+        }
+    }
+    return m >> 32;
+}
+
+//
+// Draws several dice with the same number of faces out of one u64.
+//
+// Multiplying a random u64 by faces^k gives a value in [0, faces^k) in the
+// high half, which is k uniform dice as mixed-radix digits. Rather than
+// dividing them out, we multiply by faces k times, peeling one digit off
+// the top each time; the low half left over after the last one is
+// exactly the low half of the full product, so Lemire's rejection test
+// works on it unchanged.
+// https://arxiv.org/abs/2408.06213
+//
+// A d6 pool needs one u64 per 24 dice instead of one u32 per die.
+//
+enum {MIXED_RADIX_MAX = 64};
+typedef struct MixedRadixSampler {
+    // faces^per_draw
+    uint64_t span;
+    // -span % span, or UINT64_MAX if not computed yet.
+    uint64_t threshold;
+    uint32_t faces;
+    // How many dice each draw produces.
+    uint32_t per_draw;
+} MixedRadixSampler;
+
+static inline
+MixedRadixSampler
+mixed_radix_sampler(uint32_t faces){
+    assert(faces);
+    uint64_t span = 1;
+    uint32_t k = 0;
+    while(k < MIXED_RADIX_MAX && span <= UINT64_MAX / faces){
+        span *= faces;
+        k++;
+    }
+    return (MixedRadixSampler){
+        .span = span,
+        .threshold = UINT64_MAX,
+        .faces = faces,
+        .per_draw = k,
+    };
+}
+
+//
+// Writes sampler->per_draw values in [0, faces) to out.
+//
+static inline
+force_inline
+void
+mixed_radix_draw(MixedRadixSampler* sampler, RngState* rng, uint32_t* out){
+    uint32_t faces = sampler->faces;
+    uint32_t k = sampler->per_draw;
     // bounded loop to catch unitialized rng errors
-    for(size_t i = 0 ; i < 10000; i++){
-        uint32_t r = rng_random32(rng);
-        if(r >= threshold){
-            uint32_t temp = fast_reduce(r, bound);
-            // uint32_t temp = r % bound;
-            return temp;
+    for(size_t i = 0; i < RNG_MAX_REJECTS; i++){
+        uint64_t l = rng_random64(rng);
+        for(uint32_t j = 0; j < k; j++){
+            unsigned __int128 m = (unsigned __int128)l * faces;
+            out[j] = (uint32_t)(m >> 64);
+            l = (uint64_t)m;
         }
+        if(likely(l >= sampler->span))
+            return;
+        if(sampler->threshold == UINT64_MAX)
+            sampler->threshold = -sampler->span % sampler->span;
+        if(l >= sampler->threshold)
+            return;
     }
+    // Keep the last draw rather than spinning forever.
     assert(0);
-#if defined(__GNUC__) || defined(__clang__)
-    __builtin_unreachable();
-#else
-    return 0;
+}
+
+//
+// Sum of n values in [0, faces).
+// Leftover values from the last draw are discarded.
+//
+static inline
+uint64_t
+mixed_radix_sum(MixedRadixSampler* sampler, RngState* rng, uint64_t n){
+    uint32_t vals[MIXED_RADIX_MAX];
+    uint64_t sum = 0;
+    while(n){
+        mixed_radix_draw(sampler, rng, vals);
+        uint32_t take = n < sampler->per_draw? (uint32_t)n : sampler->per_draw;
+        for(uint32_t j = 0; j < take; j++)
+            sum += vals[j];
+        n -= take;
+    }
+    return sum;
+}
+
+//
+// A double in (0, 1], so that its log is finite.
+//
+static inline
+double
+rng_uniform_open(RngState* rng){
+    return (double)((rng_random64(rng) >> 11) + 1) * 0x1p-53;
+}
+
+//
+// Draws from Binomial(n, p), for counting how many of n dice succeed
+// without rolling them.
+//
+// Small means (n*p < 10) invert the cdf, walking up the pmf from 0 with one
+// draw and about n*p multiplies. Otherwise it's Hörmann's BTRS (transformed rejection
+// with squeeze), which is exact and takes about 2 draws whatever n is.
+// p above 1/2 draws the failures instead.
+// W. Hörmann, "The generation of binomial random variates", 1993.
+//
+typedef struct BinomialSampler {
+    uint32_t n;
+    // Whether the draw counts failures.
+    uint32_t flip;
+    // 0 for inversion, else the BTRS constants.
+    double b;
+    double a, c, alpha, v_r, lr, m, h;
+    // For inversion, P(0) = (1-p)^n and p/(1-p).
+    double pmf0;
+    double ratio;
+} BinomialSampler;
+
+// Stirling series tail, log(k!) - (k+0.5)log(k+1) + (k+1) - log(sqrt(2pi)).
+static inline
+double
+binomial_stirling_tail(double k){
+    static const double small[] = {
+        0.0810614667953272, 0.0413406959554092, 0.0276779256849983,
+        0.02079067210376509, 0.0166446911898211, 0.0138761288230707,
+        0.0118967099458917, 0.0104112652619720, 0.00925546218271273,
+        0.00833056343336287,
+    };
+    if(k <= 9)
+        return small[(int)k];
+    double kp1sq = (k + 1) * (k + 1);
+    return (1.0 / 12 - (1.0 / 360 - 1.0 / 1260 / kp1sq) / kp1sq) / (k + 1);
+}
+
+static inline
+BinomialSampler
+binomial_sampler(uint32_t n, double p){
+    BinomialSampler s = {.n = n};
+    if(p > 0.5){
+        p = 1 - p;
+        s.flip = 1;
+    }
+    if(p <= 0 || !n)
+        return s;
+    if(n * p < 10){
+        s.pmf0 = exp(n * log1p(-p));
+        s.ratio = p / (1 - p);
+        return s;
+    }
+    double q = 1 - p;
+    double spq = sqrt(n * p * q);
+    s.b = 1.15 + 2.53 * spq;
+    s.a = -0.0873 + 0.0248 * s.b + 0.01 * p;
+    s.c = n * p + 0.5;
+    s.alpha = (2.83 + 5.1 / s.b) * spq;
+    s.v_r = 0.92 - 4.2 / s.b;
+    double r = p / q;
+    s.lr = log(r);
+    s.m = floor((n + 1) * p);
+    s.h = binomial_stirling_tail(s.m) + binomial_stirling_tail(n - s.m);
+    return s;
+}
+
+static inline
+uint32_t
+binomial_sampler_draw(const BinomialSampler* s, RngState* rng){
+    uint32_t n = s->n;
+    uint32_t k = 0;
+    if(s->b != 0){
+        for(;;){
+            double u = rng_uniform_open(rng) - 0.5;
+            double v = rng_uniform_open(rng);
+            double us = 0.5 - fabs(u);
+            double kf = floor((2 * s->a / us + s->b) * u + s->c);
+            if(kf < 0 || kf > n) continue;
+            // Squeeze: inside the box the hat and the pmf agree.
+            if(us >= 0.07 && v <= s->v_r){
+                k = (uint32_t)kf;
+                break;
+            }
+            v = log(v * s->alpha / (s->a / (us * us) + s->b));
+            double nm = n - s->m + 1;
+            double nk = n - kf + 1;
+            double bound = (s->m + 0.5) * (log((s->m + 1) / nm) - s->lr)
+                + (n + 1) * log(nm / nk)
+                + (kf + 0.5) * (log(nk / (kf + 1)) + s->lr)
+                + s->h - binomial_stirling_tail(kf) - binomial_stirling_tail(n - kf);
+            if(v <= bound){
+                k = (uint32_t)kf;
+                break;
+            }
+        }
+    }
+    else if(s->pmf0 != 0){
+        // P(k+1) = P(k) * (n-k)/(k+1) * p/(1-p)
+        double u = rng_uniform_open(rng);
+        double f = s->pmf0;
+        while(u > f && k < n){
+            u -= f;
+            f *= s->ratio * (n - k) / (k + 1);
+            k++;
+        }
+    }
+    return s->flip? n - k : k;
+}
+
+//
+// Several independent PCG32 streams advanced side by side, for summing big
+// pools of dice.
+//
+// Each step of a single stream depends on the previous one, so one stream
+// can never go faster than a multiply per draw. The lanes don't depend on
+// each other, so they can be stepped in vector registers. Every kernel
+// variant below runs the same algorithm and gives identical results.
+//
+enum {RNG_LANES = 8};
+typedef struct RngLanes {
+    _Alignas(64) uint64_t state[RNG_LANES];
+    _Alignas(64) uint64_t inc[RNG_LANES];
+} RngLanes;
+
+//
+// Seeds every lane with its own stream, drawing the seeds from rng.
+//
+static inline
+void
+rng_lanes_seed(RngLanes* lanes, RngState* rng){
+    for(int i = 0; i < RNG_LANES; i++){
+        uint64_t initstate = rng_random64(rng);
+        uint64_t initseq = rng_random64(rng);
+        RngState lane = {.engine = RNG_PCG32};
+        seed_rng_fixed(&lane, initstate, initseq);
+        lanes->state[i] = lane.pcg32.state;
+        lanes->inc[i] = lane.pcg32.inc;
+    }
+}
+
+//
+// Hot kernels that are compiled for several instruction sets.
+//
+typedef struct RngKernels {
+    const char* name;
+    //
+    // Bounded reduction and summation for dice pools.
+    // Each round steps every lane once and keeps the draws in [0, bound)
+    // that aren't rejected, stopping while a whole round still fits.
+    // Returns the sum and leaves the number still to draw in *n.
+    uint64_t (*lanes_rounds)(RngLanes* lanes, uint32_t bound, uint32_t threshold, uint64_t* n);
+    //
+    // Bulk generation. Fills `out` with raw outputs, lane by lane within
+    // each round. `n` must be a multiple of RNG_LANES.
+    void (*lanes_fill)(RngLanes* lanes, uint32_t* out, size_t n);
+} RngKernels;
+
+static inline
+force_inline
+uint32_t
+rng_output(uint64_t oldstate){
+    uint32_t xorshifted = (uint32_t) ( ((oldstate >> 18u) ^ oldstate) >> 27u);
+    uint32_t rot = oldstate >> 59u;
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+// Auto-vectorizing this with only SSE2 (no 64 bit multiplies) is slower
+// than leaving it scalar.
+__attribute__((optimize("no-tree-vectorize")))
+#endif
+static
+uint64_t
+rng_lanes_rounds_scalar(RngLanes* lanes, uint32_t bound, uint32_t threshold, uint64_t* n){
+    uint64_t remaining = *n;
+    uint64_t state[RNG_LANES];
+    uint64_t acc[RNG_LANES] = {0};
+    memcpy(state, lanes->state, sizeof state);
+    while(remaining >= RNG_LANES){
+        unsigned accepted = 0;
+#ifdef __clang__
+        #pragma clang loop vectorize(disable)
+#endif
+        for(int i = 0; i < RNG_LANES; i++){
+            uint64_t old = state[i];
+            state[i] = old * 6364136223846793005ULL + lanes->inc[i];
+            uint64_t m = (uint64_t)rng_output(old) * (uint64_t)bound;
+            uint64_t keep = (uint32_t)m >= threshold;
+            acc[i] += (m >> 32) & -keep;
+            accepted += (unsigned)keep;
+        }
+        remaining -= accepted;
+    }
+    memcpy(lanes->state, state, sizeof state);
+    uint64_t sum = 0;
+    for(int i = 0; i < RNG_LANES; i++)
+        sum += acc[i];
+    *n = remaining;
+    return sum;
+}
+
+static
+void
+rng_lanes_fill_scalar(RngLanes* lanes, uint32_t* out, size_t n){
+    uint64_t state[RNG_LANES];
+    memcpy(state, lanes->state, sizeof state);
+    for(size_t j = 0; j < n; j += RNG_LANES){
+        for(int i = 0; i < RNG_LANES; i++){
+            uint64_t old = state[i];
+            state[i] = old * 6364136223846793005ULL + lanes->inc[i];
+            out[j+i] = rng_output(old);
+        }
+    }
+    memcpy(lanes->state, state, sizeof state);
+}
+
+#ifdef RNG_X86_KERNELS
+#define RNG_AVX2 __attribute__((target("avx2")))
+// Low 64 bits of a 64x64 bit multiply, per lane.
+static inline
+force_inline
+RNG_AVX2
+__m256i
+rng_mul64_avx2(__m256i a, __m256i b){
+    __m256i lo = _mm256_mul_epu32(a, b);
+    __m256i cross = _mm256_add_epi64(
+        _mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+        _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+    return _mm256_add_epi64(lo, _mm256_slli_epi64(cross, 32));
+}
+
+// rng_output, leaving the result in the low half of each 64 bit lane.
+static inline
+force_inline
+RNG_AVX2
+__m256i
+rng_output_avx2(__m256i old){
+    __m256i xorshifted = _mm256_and_si256(
+        _mm256_srli_epi64(_mm256_xor_si256(_mm256_srli_epi64(old, 18), old), 27),
+        _mm256_set1_epi64x(0xffffffff));
+    __m256i rot = _mm256_srli_epi64(old, 59);
+    __m256i rotl = _mm256_sub_epi32(_mm256_set1_epi64x(32), rot);
+    return _mm256_or_si256(
+        _mm256_srlv_epi32(xorshifted, rot),
+        _mm256_sllv_epi32(xorshifted, rotl));
+}
+
+static
+RNG_AVX2
+uint64_t
+rng_lanes_rounds_avx2(RngLanes* lanes, uint32_t bound, uint32_t threshold, uint64_t* n){
+    uint64_t remaining = *n;
+    const __m256i mult = _mm256_set1_epi64x(6364136223846793005ULL);
+    const __m256i vbound = _mm256_set1_epi64x(bound);
+    const __m256i vthreshold = _mm256_set1_epi64x(threshold);
+    const __m256i lomask = _mm256_set1_epi64x(0xffffffff);
+    __m256i s0 = _mm256_load_si256((const __m256i*)&lanes->state[0]);
+    __m256i s1 = _mm256_load_si256((const __m256i*)&lanes->state[4]);
+    const __m256i i0 = _mm256_load_si256((const __m256i*)&lanes->inc[0]);
+    const __m256i i1 = _mm256_load_si256((const __m256i*)&lanes->inc[4]);
+    __m256i acc0 = _mm256_setzero_si256();
+    __m256i acc1 = _mm256_setzero_si256();
+    while(remaining >= RNG_LANES){
+        __m256i m0 = _mm256_mul_epu32(rng_output_avx2(s0), vbound);
+        __m256i m1 = _mm256_mul_epu32(rng_output_avx2(s1), vbound);
+        s0 = _mm256_add_epi64(rng_mul64_avx2(s0, mult), i0);
+        s1 = _mm256_add_epi64(rng_mul64_avx2(s1, mult), i1);
+        // Both sides fit in 32 bits, so a signed compare is fine.
+        __m256i rej0 = _mm256_cmpgt_epi64(vthreshold, _mm256_and_si256(m0, lomask));
+        __m256i rej1 = _mm256_cmpgt_epi64(vthreshold, _mm256_and_si256(m1, lomask));
+        acc0 = _mm256_add_epi64(acc0, _mm256_andnot_si256(rej0, _mm256_srli_epi64(m0, 32)));
+        acc1 = _mm256_add_epi64(acc1, _mm256_andnot_si256(rej1, _mm256_srli_epi64(m1, 32)));
+        int rejected = __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(rej0)))
+                     + __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(rej1)));
+        remaining -= RNG_LANES - rejected;
+    }
+    _mm256_store_si256((__m256i*)&lanes->state[0], s0);
+    _mm256_store_si256((__m256i*)&lanes->state[4], s1);
+    _Alignas(32) uint64_t parts[4];
+    _mm256_store_si256((__m256i*)parts, _mm256_add_epi64(acc0, acc1));
+    *n = remaining;
+    return parts[0] + parts[1] + parts[2] + parts[3];
+}
+
+static
+RNG_AVX2
+void
+rng_lanes_fill_avx2(RngLanes* lanes, uint32_t* out, size_t n){
+    const __m256i mult = _mm256_set1_epi64x(6364136223846793005ULL);
+    // Gathers the low half of each 64 bit lane into the low 128 bits.
+    const __m256i evens = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    __m256i s0 = _mm256_load_si256((const __m256i*)&lanes->state[0]);
+    __m256i s1 = _mm256_load_si256((const __m256i*)&lanes->state[4]);
+    const __m256i i0 = _mm256_load_si256((const __m256i*)&lanes->inc[0]);
+    const __m256i i1 = _mm256_load_si256((const __m256i*)&lanes->inc[4]);
+    for(size_t j = 0; j < n; j += RNG_LANES){
+        __m256i o0 = _mm256_permutevar8x32_epi32(rng_output_avx2(s0), evens);
+        __m256i o1 = _mm256_permutevar8x32_epi32(rng_output_avx2(s1), evens);
+        s0 = _mm256_add_epi64(rng_mul64_avx2(s0, mult), i0);
+        s1 = _mm256_add_epi64(rng_mul64_avx2(s1, mult), i1);
+        __m256i both = _mm256_permute2x128_si256(o0, o1, 0x20);
+        _mm256_storeu_si256((__m256i*)(out+j), both);
+    }
+    _mm256_store_si256((__m256i*)&lanes->state[0], s0);
+    _mm256_store_si256((__m256i*)&lanes->state[4], s1);
+}
+#undef RNG_AVX2
+
+// AVX-512 fits all the lanes in one register and has native 64 bit
+// multiplies, rotates and compares into masks.
+#define RNG_AVX512 __attribute__((target("avx512f,avx512dq")))
+static inline
+force_inline
+RNG_AVX512
+__m512i
+rng_output_avx512(__m512i old){
+    __m512i xorshifted = _mm512_and_si512(
+        _mm512_srli_epi64(_mm512_xor_si512(_mm512_srli_epi64(old, 18), old), 27),
+        _mm512_set1_epi64(0xffffffff));
+    __m512i rot = _mm512_srli_epi64(old, 59);
+    return _mm512_rorv_epi32(xorshifted, rot);
+}
+
+static
+RNG_AVX512
+uint64_t
+rng_lanes_rounds_avx512(RngLanes* lanes, uint32_t bound, uint32_t threshold, uint64_t* n){
+    uint64_t remaining = *n;
+    const __m512i mult = _mm512_set1_epi64(6364136223846793005ULL);
+    const __m512i vbound = _mm512_set1_epi64(bound);
+    const __m512i vthreshold = _mm512_set1_epi64(threshold);
+    const __m512i lomask = _mm512_set1_epi64(0xffffffff);
+    __m512i s = _mm512_load_si512(lanes->state);
+    const __m512i inc = _mm512_load_si512(lanes->inc);
+    __m512i acc = _mm512_setzero_si512();
+    while(remaining >= RNG_LANES){
+        __m512i m = _mm512_mul_epu32(rng_output_avx512(s), vbound);
+        s = _mm512_add_epi64(_mm512_mullo_epi64(s, mult), inc);
+        __mmask8 keep = _mm512_cmpge_epu64_mask(_mm512_and_si512(m, lomask), vthreshold);
+        acc = _mm512_mask_add_epi64(acc, keep, acc, _mm512_srli_epi64(m, 32));
+        remaining -= __builtin_popcount(keep);
+    }
+    _mm512_store_si512(lanes->state, s);
+    *n = remaining;
+    return _mm512_reduce_add_epi64(acc);
+}
+
+static
+RNG_AVX512
+void
+rng_lanes_fill_avx512(RngLanes* lanes, uint32_t* out, size_t n){
+    const __m512i mult = _mm512_set1_epi64(6364136223846793005ULL);
+    __m512i s = _mm512_load_si512(lanes->state);
+    const __m512i inc = _mm512_load_si512(lanes->inc);
+    for(size_t j = 0; j < n; j += RNG_LANES){
+        __m256i o = _mm512_cvtepi64_epi32(rng_output_avx512(s));
+        s = _mm512_add_epi64(_mm512_mullo_epi64(s, mult), inc);
+        _mm256_storeu_si256((__m256i*)(out+j), o);
+    }
+    _mm512_store_si512(lanes->state, s);
+}
+#undef RNG_AVX512
+#endif
+
+static const RngKernels rng_kernels_scalar = {
+    .name = "scalar",
+    .lanes_rounds = rng_lanes_rounds_scalar,
+    .lanes_fill = rng_lanes_fill_scalar,
+};
+
+#ifdef RNG_X86_KERNELS
+static const RngKernels rng_kernels_avx2 = {
+    .name = "avx2",
+    .lanes_rounds = rng_lanes_rounds_avx2,
+    .lanes_fill = rng_lanes_fill_avx2,
+};
+
+static const RngKernels rng_kernels_avx512 = {
+    .name = "avx512",
+    .lanes_rounds = rng_lanes_rounds_avx512,
+    .lanes_fill = rng_lanes_fill_avx512,
+};
 #endif
+
+// The kernels in use. Set once at startup by rng_select_kernels.
+static const RngKernels* rng_kernels = &rng_kernels_scalar;
+
+//
+// Picks the best kernels this cpu supports. Call once, before starting any
+// threads.
+//
+static inline
+void
+rng_select_kernels(void){
+#ifdef RNG_X86_KERNELS
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq"))
+        rng_kernels = &rng_kernels_avx512;
+    else if(__builtin_cpu_supports("avx2"))
+        rng_kernels = &rng_kernels_avx2;
+#endif
+}
+
+//
+// Draws values in [0, sampler->bound) until n have been accepted and returns
+// their sum.
+//
+static inline
+uint64_t
+rng_lanes_sum_bounded(RngLanes* lanes, BoundedSampler* sampler, uint64_t n){
+    uint32_t bound = sampler->bound;
+    // We are going to use the threshold for every draw, so just compute it.
+    if(sampler->threshold == UINT32_MAX)
+        sampler->threshold = -bound % bound;
+    uint64_t sum = rng_kernels->lanes_rounds(lanes, bound, sampler->threshold, &n);
+    // The stragglers come from the first lane.
+    RngState rng = {.engine = RNG_PCG32, .pcg32 = {.state = lanes->state[0], .inc = lanes->inc[0]}};
+    for(; n; n--)
+        sum += bounded_sampler_draw(sampler, &rng);
+    lanes->state[0] = rng.pcg32.state;
+    return sum;
 }
 
 #ifdef __clang__
@@ -0,0 +1,139 @@
+//
+// Copyright © 2021-2022, David Priver
+//
+#ifndef RNGPOOL_C
+#define RNGPOOL_C
+#include "rngpool.h"
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#endif
+
+enum {
+    RNGPOOL_HELPER_SLEEPING = 1,
+    RNGPOOL_CONSUMER_SLEEPING = 2,
+};
+
+//
+// Waits until *index isn't `value` anymore, returning the new value.
+// `who` is this side's RNGPOOL_*_SLEEPING bit.
+//
+static
+uint32_t
+rngpool_wait(RngPool* pool, uint32_t* index, uint32_t value, uint32_t who){
+    for(int i = 0; i < RNGPOOL_SPINS; i++){
+        uint32_t now = __atomic_load_n(index, __ATOMIC_ACQUIRE);
+        if(now != value) return now;
+        thread_pause();
+    }
+    for(;;){
+        // Sequentially consistent, so either the other side sees that we
+        // are sleeping or we see that it moved on. If it moves on after
+        // this, the wait doesn't sleep.
+        __atomic_or_fetch(&pool->sleeping, who, __ATOMIC_SEQ_CST);
+        uint32_t now = __atomic_load_n(index, __ATOMIC_SEQ_CST);
+        if(now == value){
+            thread_wait_while(index, value);
+            now = __atomic_load_n(index, __ATOMIC_ACQUIRE);
+        }
+        __atomic_and_fetch(&pool->sleeping, ~who, __ATOMIC_RELAXED);
+        if(now != value) return now;
+    }
+}
+
+//
+// Publishes a new value of *index, waking the other side if it may be
+// asleep on it.
+//
+static
+void
+rngpool_publish(RngPool* pool, uint32_t* index, uint32_t value, uint32_t other){
+    __atomic_store_n(index, value, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&pool->sleeping, __ATOMIC_SEQ_CST) & other)
+        thread_wake_all(index);
+}
+
+static
+void
+rngpool_fill(void* p){
+    RngPool* pool = p;
+    uint32_t head = pool->head;
+    uint32_t tail = __atomic_load_n(&pool->tail, __ATOMIC_ACQUIRE);
+    for(;;){
+        if(__atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE))
+            return;
+        if(head - tail == RNGPOOL_BUFFERS){
+            tail = rngpool_wait(pool, &pool->tail, tail, RNGPOOL_HELPER_SLEEPING);
+            continue;
+        }
+        uint32_t* buffer = pool->buffers[head % RNGPOOL_BUFFERS];
+        rng_kernels->lanes_fill(&pool->lanes, buffer, RNGPOOL_WORDS);
+        head++;
+        rngpool_publish(pool, &pool->head, head, RNGPOOL_CONSUMER_SLEEPING);
+        tail = __atomic_load_n(&pool->tail, __ATOMIC_ACQUIRE);
+    }
+}
+
+static
+uint32_t
+rngpool_refill(RngState* rng){
+    RngPool* pool = rng->pool.pool;
+    uint32_t tail = pool->tail;
+    // Give back the one we were reading.
+    if(pool->holding){
+        tail++;
+        rngpool_publish(pool, &pool->tail, tail, RNGPOOL_HELPER_SLEEPING);
+    }
+    uint32_t head = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+    while(head == tail)
+        head = rngpool_wait(pool, &pool->head, head, RNGPOOL_CONSUMER_SLEEPING);
+    pool->holding = true;
+    const uint32_t* buffer = pool->buffers[tail % RNGPOOL_BUFFERS];
+    rng->pool.cursor = buffer + 1;
+    rng->pool.end = buffer + RNGPOOL_WORDS;
+    return buffer[0];
+}
+
+RNGPOOL_API
+int
+rngpool_start(RngPool* pool, RngState* seed){
+    rng_lanes_seed(&pool->lanes, seed);
+    pool->head = 0;
+    pool->tail = 0;
+    pool->holding = false;
+    pool->sleeping = 0;
+    pool->stop = 0;
+    if(thread_spawn(&pool->thread, rngpool_fill, pool))
+        return 1;
+    return 0;
+}
+
+RNGPOOL_API
+void
+rngpool_attach(RngPool* pool, RngState* rng){
+    *rng = (RngState){
+        .engine = RNG_POOL,
+        .pool = {
+            .cursor = NULL,
+            .end = NULL,
+            .refill = rngpool_refill,
+            .pool = pool,
+        },
+    };
+}
+
+RNGPOOL_API
+void
+rngpool_stop(RngPool* pool){
+    __atomic_store_n(&pool->stop, 1, __ATOMIC_RELEASE);
+    // The consumer is done, so move tail to wake the helper if it's waiting
+    // for room. Changing the word it sleeps on means it can't miss this.
+    rngpool_publish(pool, &pool->tail, pool->tail + 1, RNGPOOL_HELPER_SLEEPING);
+    thread_join(&pool->thread);
+}
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
+
+#endif
@@ -0,0 +1,90 @@
+//
+// Copyright © 2021-2022, David Priver
+//
+#ifndef RNGPOOL_H
+#define RNGPOOL_H
+#include <stdbool.h>
+#include <stdint.h>
+#include "rng.h"
+#include "thread_utils.h"
+
+#ifndef RNGPOOL_API
+#define RNGPOOL_API extern
+#endif
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#endif
+
+//
+// Random words made ahead of time on a helper thread.
+//
+// The helper fills buffers with the multi-lane generator and hands them
+// over through a lock-free single-producer/single-consumer ring. `head`
+// counts the buffers filled and `tail` the buffers given back; each side
+// only writes its own, with release stores that pair with the other side's
+// acquire loads. They only look at each other's once per buffer, so the
+// consumer's hot path is just reading the next word.
+//
+// A side that finds the ring full (or empty) spins for a bit and then
+// sleeps on the other side's index (see thread_wait_while). `sleeping`
+// says who might be asleep, so the one that moves its index only makes the
+// system call to wake them when it has to.
+//
+// A RngPool is big, so it should be static instead of on the stack.
+//
+enum {
+    // Words per buffer. 64K, so a buffer stays in L2.
+    RNGPOOL_WORDS = 1 << 14,
+    RNGPOOL_BUFFERS = 8,
+    // How many times to check the other side before going to sleep.
+    RNGPOOL_SPINS = 1 << 12,
+};
+
+typedef struct RngPool {
+    _Alignas(64) uint32_t buffers[RNGPOOL_BUFFERS][RNGPOOL_WORDS];
+    RngLanes lanes;
+    ThreadHandle thread;
+    // Each on its own cache line so the two sides don't fight over them.
+    // Buffers filled. Only written by the helper.
+    _Alignas(64) uint32_t head;
+    // Buffers given back. Only written by the consumer (and by
+    // rngpool_stop, after the consumer is done).
+    _Alignas(64) uint32_t tail;
+    // Whether the consumer holds buffers[tail].
+    bool holding;
+    // Bit 0: the helper may be asleep on tail. Bit 1: the consumer may be
+    // asleep on head.
+    _Alignas(64) uint32_t sleeping;
+    // Set (atomically) to make the helper exit.
+    int stop;
+} RngPool;
+
+//
+// Starts the helper thread, seeding its lanes from `seed`.
+// Returns non-zero on failure.
+//
+RNGPOOL_API
+int
+rngpool_start(RngPool* pool, RngState* seed);
+
+//
+// Makes `rng` an RNG_POOL engine that draws from `pool`.
+// Only one rng may draw from a pool.
+//
+RNGPOOL_API
+void
+rngpool_attach(RngPool* pool, RngState* rng);
+
+//
+// Stops and joins the helper thread.
+//
+RNGPOOL_API
+void
+rngpool_stop(RngPool* pool);
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
+
+#endif
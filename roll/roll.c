@@ -4,46 +4,64 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdint.h>
+#include <math.h>
 #ifndef _WIN32
 #include <unistd.h>
 static inline int stdin_is_interactive(void){
     return isatty(STDIN_FILENO);
 }
+static inline long long read_stdin(void* buff, size_t n){
+    return read(STDIN_FILENO, buff, n);
+}
 #else
 #include <io.h>
 static inline int stdin_is_interactive(void){
     return _isatty(0);
 }
+static inline long long read_stdin(void* buff, size_t n){
+    return _read(0, buff, (unsigned)n);
+}
 #endif
 #include "common_macros.h"
 #include "rng.h"
 #include "long_string.h"
-#include "StringBuilder.h"
 #include "get_input.h"
 #include "argument_parsing.h"
 #include "diceparse.h"
+#include "dicevm.h"
+#include "dicedist.h"
+#include "thread_utils.h"
+#include "rngpool.h"
+#include "rolltable.h"
 
 static struct LineHistory history;
+// For --pregen. Too big for the stack.
+static RngPool rng_pool;
+// For showing which kept dice were dropped. Faces and counts fit in 16
+// bits, so these are big enough for any pool.
+static uint32_t keep_rolls[UINT16_MAX];
+static uint32_t keep_histogram[UINT16_MAX];
 
 #ifdef __clang__
 #pragma clang assume_nonnull begin
 #endif
 
-static
-int64_t
-validate_inner(DiceParseExpr* exprs, DiceParseExpr expr);
-
-static
-bool
-validate(DiceParseExpr* exprs, DiceParseExpr expr){
-    int64_t biggest_value = validate_inner(exprs, expr);
-    return biggest_value >= 0 && biggest_value <= INT64_MAX;
-}
+//
+// Verbose rolling, --dist and --moments walk the expression recursively, so
+// they report an error past this depth rather than overflow the stack on huge generated expressions.
+//
+enum {MAX_RECURSION_DEPTH = 4096};
 
+//
+// The biggest magnitude a node without sub-expressions can take, or -1 if
+// it is too big.
+//
 static
 int64_t
-validate_inner(DiceParseExpr* exprs, DiceParseExpr expr){
+validate_leaf(const DiceParseExprBuffer* buff, DiceParseExpr expr){
+    const DiceParseExpr* exprs = buff->exprs;
     switch((DiceParseExpressionType)expr.type){
         case DICEPARSE_NUMBER:
             return expr.primary;
@@ -52,67 +70,188 @@ validate_inner(DiceParseExpr* exprs, DiceParseExpr expr){
                 return 0;
             // dice are limited to uint16, so we can safely multiply
             return (int64_t)expr.primary * (int64_t)expr.secondary;
-        case DICEPARSE_BINARY:{
-            int64_t lhs = validate_inner(exprs, exprs[expr.primary]);
-            if(lhs < 0) return lhs;
-            int64_t rhs = validate_inner(exprs, exprs[expr.secondary]);
-            if(rhs < 0) return rhs;
-            int64_t result;
-            switch((DiceParseBinOp)expr.type2){
-                case DICEPARSE_ADD:
-                    if(__builtin_add_overflow(lhs, rhs, &result))
-                        return -1;
-                    return result;
-                // this might be overly conservative
-                case DICEPARSE_SUBTRACT:
-                    if(__builtin_add_overflow(lhs, rhs, &result))
-                        return -1;
-                    return result;
-                case DICEPARSE_MULTIPLY:
-                    if(__builtin_mul_overflow(lhs, rhs, &result))
-                        return -1;
-                    return result;
-                case DICEPARSE_DIVIDE:
-                    if(!rhs) return 0;
-                    // Hmm. we need an actual min to do this one.
-                    return lhs / 1;
-                case DICEPARSE_EQ:
-                    return 1;
-                case DICEPARSE_NOT_EQ:
-                    return 1;
-                case DICEPARSE_LESS:
-                    return 1;
-                case DICEPARSE_LESS_EQ:
-                    return 1;
-                case DICEPARSE_GREATER:
-                    return 1;
-                case DICEPARSE_GREATER_EQ:
-                    return 1;
-            }
+        case DICEPARSE_KEEP:
+            // faces are limited to uint16 and so is the count
+            return (int64_t)exprs[expr.primary].primary * (int64_t)expr.secondary;
+        case DICEPARSE_SUCCESS:
+            return exprs[expr.primary].secondary;
+        case DICEPARSE_CUSTOM:{
+            // Faces are int32 and the count is uint16, so this can't
+            // overflow.
+            const DiceParseCustomDie* c = &buff->customs[expr.primary];
+            int64_t biggest = c->max;
+            if(-(int64_t)c->min > biggest) biggest = -(int64_t)c->min;
+            return biggest * expr.secondary;
         }
-        case DICEPARSE_UNARY:{
-            int64_t rhs = validate_inner(exprs, exprs[expr.primary]);
-            if(rhs < 0) return rhs;
-            switch((DiceParseUnaryOp)expr.type2){
-                case DICEPARSE_PLUS:
-                    return rhs;
-                case DICEPARSE_NEG:
-                    return rhs;
-                case DICEPARSE_NOT:
-                    return 1;
+        case DICEPARSE_EXPLODE:
+            // Each die is rolled at most DICEPARSE_MAX_EXPLOSIONS+1 times.
+            return validate_leaf(buff, exprs[expr.primary]) * (DICEPARSE_MAX_EXPLOSIONS+1);
+        case DICEPARSE_BINARY:
+        case DICEPARSE_UNARY:
+        case DICEPARSE_GROUPING:
+            break;
+    }
+    return -1;
+}
+
+static
+int64_t
+validate_binary(DiceParseBinOp op, int64_t lhs, int64_t rhs){
+    int64_t result;
+    switch(op){
+        case DICEPARSE_ADD:
+            if(__builtin_add_overflow(lhs, rhs, &result))
+                return -1;
+            return result;
+        // this might be overly conservative
+        case DICEPARSE_SUBTRACT:
+            if(__builtin_add_overflow(lhs, rhs, &result))
+                return -1;
+            return result;
+        case DICEPARSE_MULTIPLY:
+            if(__builtin_mul_overflow(lhs, rhs, &result))
+                return -1;
+            return result;
+        case DICEPARSE_DIVIDE:
+            if(!rhs) return 0;
+            // Hmm. we need an actual min to do this one.
+            return lhs / 1;
+        case DICEPARSE_EQ:
+            return 1;
+        case DICEPARSE_NOT_EQ:
+            return 1;
+        case DICEPARSE_LESS:
+            return 1;
+        case DICEPARSE_LESS_EQ:
+            return 1;
+        case DICEPARSE_GREATER:
+            return 1;
+        case DICEPARSE_GREATER_EQ:
+            return 1;
+    }
+    return -1;
+}
+
+typedef struct ValidateBound ValidateBound;
+struct ValidateBound {
+    int64_t biggest;
+    uint32_t depth;
+};
+
+//
+// The stacks validate walks with. They are kept between calls so that
+// validating each line of a long stdin pipeline doesn't allocate.
+//
+typedef struct ValidateStack ValidateStack;
+struct ValidateStack {
+    uint32_t*_Null_unspecified work;
+    ValidateBound*_Null_unspecified bounds;
+    size_t capacity; // in nodes
+};
+
+static
+void
+validate_destroy(ValidateStack* stack){
+    free(stack->work);
+    free(stack->bounds);
+    *stack = (ValidateStack){0};
+}
+
+//
+// Checks that rolling the expression at `index` can't overflow and sets
+// `*depth` to how deeply it nests. Walks with an explicit stack like
+// dicevm_compile, as generated expressions can be arbitrarily deep.
+//
+static
+bool
+validate(const DiceParseExprBuffer* buff, int index, ValidateStack* stack, uint32_t* depth){
+    const DiceParseExpr* exprs = buff->exprs;
+    // The low bit marks a node whose children have been done. Each node is
+    // pushed at most twice and leaves one bound.
+    size_t needed = (size_t)buff->cursor + 1;
+    if(needed > stack->capacity){
+        uint32_t* new_work = realloc(stack->work, 2 * needed * sizeof(*new_work));
+        if(!new_work) return false;
+        stack->work = new_work;
+        ValidateBound* new_bounds = realloc(stack->bounds, needed * sizeof(*new_bounds));
+        if(!new_bounds) return false;
+        stack->bounds = new_bounds;
+        stack->capacity = needed;
+    }
+    uint32_t* work = stack->work;
+    ValidateBound* bounds = stack->bounds;
+    size_t top = 0;
+    size_t count = 0;
+    work[top++] = (uint32_t)index << 1;
+    while(top){
+        uint32_t item = work[--top];
+        DiceParseExpr expr = exprs[item >> 1];
+        bool children_done = item & 1;
+        ValidateBound b;
+        switch((DiceParseExpressionType)expr.type){
+            case DICEPARSE_BINARY:{
+                if(!children_done){
+                    work[top++] = item | 1;
+                    work[top++] = expr.rhs << 1;
+                    work[top++] = expr.primary << 1;
+                    continue;
+                }
+                ValidateBound rhs = bounds[--count];
+                ValidateBound lhs = bounds[--count];
+                b.biggest = validate_binary(expr.type2, lhs.biggest, rhs.biggest);
+                b.depth = 1 + (lhs.depth > rhs.depth? lhs.depth : rhs.depth);
+                break;
             }
+            case DICEPARSE_UNARY:
+            case DICEPARSE_GROUPING:
+                if(!children_done){
+                    work[top++] = item | 1;
+                    work[top++] = expr.primary << 1;
+                    continue;
+                }
+                b = bounds[--count];
+                if(expr.type == DICEPARSE_UNARY && expr.type2 == DICEPARSE_NOT)
+                    b.biggest = 1;
+                b.depth++;
+                break;
+            default:
+                b.biggest = validate_leaf(buff, expr);
+                b.depth = 1;
+                break;
         }
-        case DICEPARSE_GROUPING:
-            return validate_inner(exprs, exprs[expr.primary]);
+        if(b.biggest < 0)
+            return false;
+        bounds[count++] = b;
     }
+    *depth = bounds[0].depth;
+    return true;
 }
 
+//
+// Moves on to the next die of the trial, numbered the same way as
+// dicevm_compile numbers them. With a counter-based rng each die has its own
+// stream, so this draws each die from the same stream as dicevm_run.
+//
+static inline
+void
+roll_next_die(RngState* rng, uint32_t* die){
+    if(unlikely(rng->engine == RNG_PHILOX))
+        rng_philox_seek_die(rng, *die);
+    ++*die;
+}
+
+//
+// Rolls the expression, printing each die if verbose. `*die_index` should
+// start at 0 for each trial.
+//
 static
 int64_t
-roll_and_display(DiceParseExpr* exprs, DiceParseExpr expr, RngState* rng, bool verbose, bool tight){
+roll_and_display(const DiceParseExprBuffer* buff, DiceParseExpr expr, RngState* rng, uint32_t* die_index, bool verbose, bool tight){
+    const DiceParseExpr* exprs = buff->exprs;
     #define max_coloring "\033[92m"
     #define min_coloring "\033[91m"
     #define reset_coloring "\033[39;49m"
+    #define dropped_coloring "\033[90m"
     switch((DiceParseExpressionType)expr.type){
         case DICEPARSE_NUMBER:
             if(verbose)printf("%d", (int)expr.primary);
@@ -122,6 +261,7 @@ roll_and_display(DiceParseExpr* exprs, DiceParseExpr expr, RngState* rng, bool v
                 if(verbose)printf("[0]");
                 return 0;
             }
+            roll_next_die(rng, die_index);
             if(expr.secondary == 1){
                 int64_t num = bounded_random(rng, expr.primary) + 1;
                 if(verbose){
@@ -136,10 +276,15 @@ roll_and_display(DiceParseExpr* exprs, DiceParseExpr expr, RngState* rng, bool v
             }
             if(verbose)if(tight)putchar('(');
             int64_t val = 0;
+            MixedRadixSampler sampler = mixed_radix_sampler(expr.primary);
+            uint32_t faces[MIXED_RADIX_MAX];
             for(int i = 0; i < expr.secondary; i++){
+                uint32_t j = i % sampler.per_draw;
+                if(j == 0)
+                    mixed_radix_draw(&sampler, rng, faces);
                 if(i != 0)
                     if(verbose)putchar('+');
-                int64_t num = bounded_random(rng, expr.primary) + 1;
+                int64_t num = faces[j] + 1;
                 if(verbose){
                     const char* color = "";
                     if(num == expr.primary) 
@@ -158,95 +303,713 @@ roll_and_display(DiceParseExpr* exprs, DiceParseExpr expr, RngState* rng, bool v
             int64_t rhs;
             switch((DiceParseBinOp)expr.type2){
                 case DICEPARSE_ADD:
-                    lhs = roll_and_display(exprs, exprs[expr.primary], rng, verbose, false);
+                    lhs = roll_and_display(buff, exprs[expr.primary], rng, die_index, verbose, false);
                     if(verbose)printf(" + ");
-                    rhs = roll_and_display(exprs, exprs[expr.secondary], rng, verbose, false);
+                    rhs = roll_and_display(buff, exprs[expr.rhs], rng, die_index, verbose, false);
                     return lhs + rhs;
                 case DICEPARSE_SUBTRACT:
-                    lhs = roll_and_display(exprs, exprs[expr.primary], rng, verbose, false);
+                    lhs = roll_and_display(buff, exprs[expr.primary], rng, die_index, verbose, false);
                     if(verbose)printf(" - ");
-                    rhs = roll_and_display(exprs, exprs[expr.secondary], rng, verbose, false);
+                    rhs = roll_and_display(buff, exprs[expr.rhs], rng, die_index, verbose, false);
                     return lhs - rhs;
                 case DICEPARSE_MULTIPLY:
-                    lhs = roll_and_display(exprs, exprs[expr.primary], rng, verbose, true);
+                    lhs = roll_and_display(buff, exprs[expr.primary], rng, die_index, verbose, true);
                     if(verbose)putchar('*');
-                    rhs = roll_and_display(exprs, exprs[expr.secondary], rng, verbose, true);
+                    rhs = roll_and_display(buff, exprs[expr.rhs], rng, die_index, verbose, true);
                     return lhs * rhs;
                 case DICEPARSE_DIVIDE:
-                    lhs = roll_and_display(exprs, exprs[expr.primary], rng, verbose, true);
+                    lhs = roll_and_display(buff, exprs[expr.primary], rng, die_index, verbose, true);
                     if(verbose)putchar('/');
-                    rhs = roll_and_display(exprs, exprs[expr.secondary], rng, verbose, true);
+                    rhs = roll_and_display(buff, exprs[expr.rhs], rng, die_index, verbose, true);
                     if(!rhs) return 0;
                     return lhs / rhs;
                 case DICEPARSE_EQ:
-                    lhs = roll_and_display(exprs, exprs[expr.primary], rng, verbose, false);
+                    lhs = roll_and_display(buff, exprs[expr.primary], rng, die_index, verbose, false);
                     if(verbose)printf(" = ");
-                    rhs = roll_and_display(exprs, exprs[expr.secondary], rng, verbose, false);
+                    rhs = roll_and_display(buff, exprs[expr.rhs], rng, die_index, verbose, false);
                     return lhs == rhs;
                 case DICEPARSE_NOT_EQ:
-                    lhs = roll_and_display(exprs, exprs[expr.primary], rng, verbose, false);
+                    lhs = roll_and_display(buff, exprs[expr.primary], rng, die_index, verbose, false);
                     if(verbose)printf(" != ");
-                    rhs = roll_and_display(exprs, exprs[expr.secondary], rng, verbose, false);
+                    rhs = roll_and_display(buff, exprs[expr.rhs], rng, die_index, verbose, false);
                     return lhs != rhs;
                 case DICEPARSE_LESS:
-                    lhs = roll_and_display(exprs, exprs[expr.primary], rng, verbose, false);
+                    lhs = roll_and_display(buff, exprs[expr.primary], rng, die_index, verbose, false);
                     if(verbose)printf(" < ");
-                    rhs = roll_and_display(exprs, exprs[expr.secondary], rng, verbose, false);
+                    rhs = roll_and_display(buff, exprs[expr.rhs], rng, die_index, verbose, false);
                     return lhs < rhs;
                 case DICEPARSE_LESS_EQ:
-                    lhs = roll_and_display(exprs, exprs[expr.primary], rng, verbose, false);
+                    lhs = roll_and_display(buff, exprs[expr.primary], rng, die_index, verbose, false);
                     if(verbose)printf(" <= ");
-                    rhs = roll_and_display(exprs, exprs[expr.secondary], rng, verbose, false);
+                    rhs = roll_and_display(buff, exprs[expr.rhs], rng, die_index, verbose, false);
                     return lhs <= rhs;
                 case DICEPARSE_GREATER:
-                    lhs = roll_and_display(exprs, exprs[expr.primary], rng, verbose, false);
+                    lhs = roll_and_display(buff, exprs[expr.primary], rng, die_index, verbose, false);
                     if(verbose)printf(" > ");
-                    rhs = roll_and_display(exprs, exprs[expr.secondary], rng, verbose, false);
+                    rhs = roll_and_display(buff, exprs[expr.rhs], rng, die_index, verbose, false);
                     return lhs > rhs;
                 case DICEPARSE_GREATER_EQ:
-                    lhs = roll_and_display(exprs, exprs[expr.primary], rng, verbose, false);
+                    lhs = roll_and_display(buff, exprs[expr.primary], rng, die_index, verbose, false);
                     if(verbose)printf(" >= ");
-                    rhs = roll_and_display(exprs, exprs[expr.secondary], rng, verbose, false);
+                    rhs = roll_and_display(buff, exprs[expr.rhs], rng, die_index, verbose, false);
                     return lhs >= rhs;
             }
         }
         case DICEPARSE_GROUPING:{
             if(verbose)putchar('(');
-            int64_t val = roll_and_display(exprs, exprs[expr.primary], rng, verbose, false);
+            int64_t val = roll_and_display(buff, exprs[expr.primary], rng, die_index, verbose, false);
             if(verbose)putchar(')');
             return val;
         }
+        case DICEPARSE_KEEP:{
+            DiceParseExpr die = exprs[expr.primary];
+            uint32_t faces = die.primary;
+            uint32_t count = die.secondary;
+            if(!faces || !count || !expr.secondary){
+                if(verbose)printf("[0]");
+                return 0;
+            }
+            roll_next_die(rng, die_index);
+            // Rolls are kept so we can show which were dropped, and the
+            // histogram gives the cut-off without sorting.
+            uint32_t* rolls = keep_rolls;
+            uint32_t* hist = keep_histogram;
+            memset(hist, 0, faces * sizeof(*hist));
+            // Same draws as the VM.
+            if(count == 1)
+                rolls[0] = bounded_random(rng, faces);
+            else {
+                MixedRadixSampler sampler = mixed_radix_sampler(faces);
+                uint32_t vals[MIXED_RADIX_MAX];
+                for(uint32_t i = 0; i < count; i++){
+                    uint32_t j = i % sampler.per_draw;
+                    if(j == 0)
+                        mixed_radix_draw(&sampler, rng, vals);
+                    rolls[i] = vals[j];
+                }
+            }
+            for(uint32_t i = 0; i < count; i++)
+                hist[rolls[i]]++;
+            // Faces strictly past the cut-off are all kept, and then the
+            // first `ties` dice showing the cut-off itself.
+            bool lowest = expr.type2 == DICEPARSE_KEEP_LOWEST;
+            uint32_t need = expr.secondary;
+            uint32_t cut = 0;
+            for(uint32_t k = 0; k < faces; k++){
+                uint32_t v = lowest? k : faces - 1 - k;
+                if(hist[v] >= need){
+                    cut = v;
+                    break;
+                }
+                need -= hist[v];
+            }
+            uint32_t ties = need;
+            if(verbose)if(tight)putchar('(');
+            int64_t val = 0;
+            for(uint32_t i = 0; i < count; i++){
+                uint32_t v = rolls[i];
+                bool kept = lowest? v < cut : v > cut;
+                if(v == cut && ties){
+                    kept = true;
+                    ties--;
+                }
+                int64_t num = v + 1;
+                if(kept)
+                    val += num;
+                if(verbose){
+                    if(i != 0)
+                        putchar('+');
+                    const char* color = "";
+                    if(!kept)
+                        color = dropped_coloring;
+                    else if(num == faces)
+                        color = max_coloring;
+                    else if(num == 1)
+                        color = min_coloring;
+                    printf("[%s%lld%s]", color, (long long)num, reset_coloring);
+                }
+            }
+            if(verbose)if(tight)putchar(')');
+            return val;
+        }
+        case DICEPARSE_CUSTOM:{
+            const DiceParseCustomDie* c = &buff->customs[expr.primary];
+            const DiceParseFace* faces = &buff->faces[c->first];
+            if(expr.secondary)
+                roll_next_die(rng, die_index);
+            if(verbose)if(tight && expr.secondary > 1)putchar('(');
+            int64_t val = 0;
+            for(int i = 0; i < expr.secondary; i++){
+                // Same draws as the VM.
+                int64_t num = diceparse_custom_face(faces, c->count, rng_random64(rng));
+                val += num;
+                if(verbose){
+                    if(i != 0)
+                        putchar('+');
+                    const char* color = "";
+                    if(c->min == c->max)
+                        color = "";
+                    else if(num == c->max)
+                        color = max_coloring;
+                    else if(num == c->min)
+                        color = min_coloring;
+                    printf("[%s%lld%s]", color, (long long)num, reset_coloring);
+                }
+            }
+            if(!expr.secondary)
+                if(verbose)printf("[0]");
+            if(verbose)if(tight && expr.secondary > 1)putchar(')');
+            return val;
+        }
+        case DICEPARSE_SUCCESS:{
+            DiceParseExpr die = exprs[expr.primary];
+            uint32_t faces = die.primary;
+            uint32_t count = die.secondary;
+            if(!faces || !count){
+                if(verbose)printf("[0]");
+                return 0;
+            }
+            uint32_t lo, hi;
+            diceparse_success_range(expr, faces, &lo, &hi);
+            // The VM doesn't roll anything if the result is fixed.
+            if(lo != hi && hi - lo != faces)
+                roll_next_die(rng, die_index);
+            // Every die is rolled so it can be shown. Successes are
+            // highlighted and failures greyed out.
+            if(verbose)if(tight)putchar('(');
+            int64_t val = 0;
+            MixedRadixSampler sampler = mixed_radix_sampler(faces);
+            uint32_t vals[MIXED_RADIX_MAX];
+            for(uint32_t i = 0; i < count; i++){
+                uint32_t j = i % sampler.per_draw;
+                if(j == 0)
+                    mixed_radix_draw(&sampler, rng, vals);
+                bool success = vals[j] >= lo && vals[j] < hi;
+                val += success;
+                if(verbose){
+                    if(i != 0)
+                        putchar(' ');
+                    printf("[%s%lld%s]", success? max_coloring : dropped_coloring, (long long)vals[j] + 1, reset_coloring);
+                }
+            }
+            if(verbose)if(tight)putchar(')');
+            return val;
+        }
+        case DICEPARSE_EXPLODE:{
+            DiceParseExpr die = exprs[expr.primary];
+            uint32_t faces = die.primary;
+            uint32_t count = die.secondary;
+            if(!faces || !count){
+                if(verbose)printf("[0]");
+                return 0;
+            }
+            roll_next_die(rng, die_index);
+            // Each die is rolled one face at a time so the chain can be
+            // shown, which the VM doesn't do.
+            if(verbose)if(tight && count > 1)putchar('(');
+            int64_t val = 0;
+            for(uint32_t i = 0; i < count; i++){
+                if(verbose){
+                    if(i != 0)
+                        putchar('+');
+                    putchar('[');
+                }
+                for(int n = 0; ; n++){
+                    int64_t num = bounded_random(rng, faces) + 1;
+                    val += num;
+                    bool explodes = num >= expr.secondary && n < DICEPARSE_MAX_EXPLOSIONS;
+                    if(verbose){
+                        const char* color = "";
+                        if(num == faces)
+                            color = max_coloring;
+                        else if(num == 1)
+                            color = min_coloring;
+                        printf("%s%lld%s%s", color, (long long)num, reset_coloring, explodes? "!" : "");
+                    }
+                    if(!explodes) break;
+                }
+                if(verbose)putchar(']');
+            }
+            if(verbose)if(tight && count > 1)putchar(')');
+            return val;
+        }
         case DICEPARSE_UNARY:{
             int64_t val;
             switch((DiceParseUnaryOp)expr.type2){
                 case DICEPARSE_PLUS:
                     if(verbose)putchar('+');
-                    val = roll_and_display(exprs, exprs[expr.primary], rng, verbose, tight);
+                    val = roll_and_display(buff, exprs[expr.primary], rng, die_index, verbose, tight);
                     return val;
                 case DICEPARSE_NEG:
                     if(verbose)putchar('-');
-                    val = -roll_and_display(exprs, exprs[expr.primary], rng, verbose, true);
+                    val = -roll_and_display(buff, exprs[expr.primary], rng, die_index, verbose, true);
                     return val;
                 case DICEPARSE_NOT:
                     if(verbose)putchar('!');
-                    val = !roll_and_display(exprs, exprs[expr.primary], rng, verbose, true);
+                    val = !roll_and_display(buff, exprs[expr.primary], rng, die_index, verbose, true);
                     return val;
             }
         }
     }
 }
+
+//
+// Reads stdin for the non-interactive mode and hands out each line as
+// segments of the read buffers, so a line that straddles a refill is parsed
+// where it lies instead of being copied out. Normally two buffers take
+// turns; a line longer than that holds on to as many as it needs.
+//
+enum {LINE_READER_CHUNK = 1<<16};
+
+typedef struct LineReader {
+    // A line starts in chunks[0] and spills over into chunks[1], ...
+    char*_Nonnull*_Nullable chunks;
+    size_t chunk_count;
+    // The chunk being read from, how far into it we are and how much of it
+    // has been filled.
+    size_t current;
+    size_t cursor;
+    size_t filled;
+    StringView*_Nullable segments;
+    size_t segment_capacity;
+    bool eof;
+} LineReader;
+
+//
+// Gets the next line, without its newline, as `*count` segments that are
+// good until the next call.
+// Returns non-zero at the end of input or on failure.
+//
+static
+int
+line_reader_next(LineReader* r, StringView*_Nullable* segments, size_t* count){
+    // What's left of the current chunk becomes chunks[0], freeing up the
+    // ones the last line spilled into.
+    if(r->current){
+        char* tmp = r->chunks[0];
+        r->chunks[0] = r->chunks[r->current];
+        r->chunks[r->current] = tmp;
+        r->current = 0;
+    }
+    size_t n = 0;
+    bool newline = false;
+    while(!newline){
+        if(r->cursor == r->filled){
+            if(r->eof)
+                break;
+            // Keep the current chunk if the line has anything in it.
+            size_t next = n? r->current + 1 : r->current;
+            if(next == r->chunk_count){
+                char** chunks = realloc(r->chunks, (r->chunk_count+1)*sizeof(*chunks));
+                if(!chunks) return 1;
+                r->chunks = chunks;
+                chunks[next] = malloc(LINE_READER_CHUNK);
+                if(!chunks[next]) return 1;
+                r->chunk_count++;
+            }
+            long long got = read_stdin(r->chunks[next], LINE_READER_CHUNK);
+            if(got <= 0){
+                r->eof = true;
+                break;
+            }
+            r->current = next;
+            r->cursor = 0;
+            r->filled = got;
+        }
+        char* chunk = r->chunks[r->current];
+        char* nl = memchr(chunk + r->cursor, '\n', r->filled - r->cursor);
+        size_t end = nl? (size_t)(nl - chunk) : r->filled;
+        if(end > r->cursor){
+            if(n == r->segment_capacity){
+                size_t capacity = r->segment_capacity? r->segment_capacity*2 : 4;
+                StringView* new_segments = realloc(r->segments, capacity*sizeof(*new_segments));
+                if(!new_segments) return 1;
+                r->segments = new_segments;
+                r->segment_capacity = capacity;
+            }
+            r->segments[n++] = (StringView){.length = end - r->cursor, .text = chunk + r->cursor};
+        }
+        r->cursor = nl? end + 1 : end;
+        newline = nl;
+    }
+    // The last line doesn't need a newline.
+    if(!newline && !n)
+        return 1;
+    *segments = r->segments;
+    *count = n;
+    return 0;
+}
+
 static
 void
-interactive_mode(bool verbose) {
+line_reader_destroy(LineReader* r){
+    for(size_t i = 0; i < r->chunk_count; i++)
+        free(r->chunks[i]);
+    free(r->chunks);
+    free(r->segments);
+    *r = (LineReader){0};
+}
+
+//
+// Batches non-verbose output so that a large count isn't a printf per roll.
+//
+typedef struct OutputBuffer {
+    size_t cursor;
+    char data[1<<16];
+} OutputBuffer;
+
+static
+void
+ob_flush(OutputBuffer* ob){
+    if(ob->cursor)
+        fwrite(ob->data, 1, ob->cursor, stdout);
+    ob->cursor = 0;
+}
+
+// Writes the value followed by a newline.
+static
+void
+ob_write_line(OutputBuffer* ob, int64_t value){
+    // 20 digits, a sign and the newline.
+    enum {MAX_LINE=22};
+    if(ob->cursor + MAX_LINE > sizeof(ob->data))
+        ob_flush(ob);
+    char tmp[MAX_LINE];
+    char* p = tmp + sizeof(tmp);
+    *--p = '\n';
+    uint64_t u = value < 0? -(uint64_t)value : (uint64_t)value;
+    do {
+        *--p = '0' + u % 10;
+        u /= 10;
+    }while(u);
+    if(value < 0)
+        *--p = '-';
+    size_t len = tmp + sizeof(tmp) - p;
+    memcpy(ob->data+ob->cursor, p, len);
+    ob->cursor += len;
+}
+
+// Writes the text followed by a newline.
+static
+void
+ob_write_text(OutputBuffer* ob, StringView text){
+    if(ob->cursor + text.length + 1 > sizeof(ob->data)){
+        ob_flush(ob);
+        if(text.length + 1 > sizeof(ob->data)){
+            fwrite(text.text, 1, text.length, stdout);
+            putchar('\n');
+            return;
+        }
+    }
+    memcpy(ob->data+ob->cursor, text.text, text.length);
+    ob->cursor += text.length;
+    ob->data[ob->cursor++] = '\n';
+}
+
+//
+// Prints " -> value" and, if there is a table, the row it lands on.
+//
+static
+void
+print_result(const RollTable*_Nullable table, int64_t value){
+    StringView row;
+    if(table && rolltable_lookup(table, value, &row))
+        printf(" -> %lld: %.*s\n", (long long)value, (int)row.length, row.text);
+    else
+        printf(" -> %lld\n", (long long)value);
+}
+
+//
+// Rolls an already validated expression `count` times, printing one
+// result per line. With a table, the row each result lands on is printed
+// instead (or the result, if it misses the table).
+// Returns non-zero on failure.
+//
+static
+int
+roll_many(DiceParseExprBuffer* buff, int index, DiceVmProgram* prog, RngState* rng, bool verbose, int64_t count, const RollTable*_Nullable table){
+    if(verbose){
+        for(int64_t i = 0; i < count; i++){
+            uint32_t die_index = 0;
+            int64_t value = roll_and_display(buff, buff->exprs[index], rng, &die_index, verbose, false);
+            rng_next_trial(rng);
+            print_result(table, value);
+        }
+        return 0;
+    }
+    if(dicevm_compile(prog, buff, index, (uint64_t)count))
+        return 1;
+    static OutputBuffer ob;
+    if(table){
+        for(int64_t i = 0; i < count; i++){
+            int64_t value = dicevm_run(prog, rng);
+            StringView row;
+            if(rolltable_lookup(table, value, &row))
+                ob_write_text(&ob, row);
+            else
+                ob_write_line(&ob, value);
+        }
+    }
+    else {
+        for(int64_t i = 0; i < count; i++)
+            ob_write_line(&ob, dicevm_run(prog, rng));
+    }
+    ob_flush(&ob);
+    return 0;
+}
+
+//
+// Running statistics for the simulation. Each worker owns one and they are
+// merged at the end (Chan et al.'s parallel variance).
+//
+typedef struct SimStats {
+    int64_t n;
+    double mean;
+    double m2;
+    int64_t min;
+    int64_t max;
+} SimStats;
+
+static inline
+void
+simstats_add(SimStats* st, int64_t value){
+    if(!st->n || value < st->min) st->min = value;
+    if(!st->n || value > st->max) st->max = value;
+    st->n++;
+    double delta = (double)value - st->mean;
+    st->mean += delta / (double)st->n;
+    st->m2 += delta * ((double)value - st->mean);
+}
+
+static
+void
+simstats_merge(SimStats* into, const SimStats* other){
+    if(!other->n) return;
+    if(!into->n){
+        *into = *other;
+        return;
+    }
+    int64_t n = into->n + other->n;
+    double delta = other->mean - into->mean;
+    into->mean += delta * (double)other->n / (double)n;
+    into->m2 += other->m2 + delta * delta * (double)into->n * (double)other->n / (double)n;
+    if(other->min < into->min) into->min = other->min;
+    if(other->max > into->max) into->max = other->max;
+    into->n = n;
+}
+
+// Trials are summarized in blocks of this many, which are merged in order at
+// the end, so the result doesn't depend on how the blocks were shared out.
+enum {SIM_BLOCK_TRIALS = 1 << 16};
+
+typedef struct SimWorker {
+    ThreadHandle thread;
+    const DiceParseExprBuffer* buff;
+    int index;
+    // Base rng of the whole run.
+    const RngState* rng;
+    int64_t trials;
+    // This worker does blocks [first_block, end_block).
+    int64_t first_block;
+    int64_t end_block;
+    SimStats* blocks;
+    int error;
+} SimWorker;
+
+static
+void
+sim_worker(void* p){
+    SimWorker* w = p;
+    // Each worker compiles its own program so nothing on the hot path is
+    // shared between threads.
+    DiceVmProgram prog = {0};
+    if(dicevm_compile(&prog, w->buff, w->index, (uint64_t)w->trials)){
+        w->error = 1;
+        return;
+    }
+    RngTrials trials;
+    rng_trials_init(&trials, w->rng);
+    rng_trials_seek(&trials, (uint64_t)w->first_block * SIM_BLOCK_TRIALS);
+    for(int64_t b = w->first_block; b < w->end_block; b++){
+        int64_t n = w->trials - b * SIM_BLOCK_TRIALS;
+        if(n > SIM_BLOCK_TRIALS) n = SIM_BLOCK_TRIALS;
+        SimStats stats = {0};
+        RngState rng;
+        for(int64_t i = 0; i < n; i++){
+            rng_trials_next(&trials, &rng);
+            simstats_add(&stats, dicevm_run(&prog, &rng));
+        }
+        w->blocks[b] = stats;
+    }
+    dicevm_destroy(&prog);
+}
+
+//
+// Rolls an already validated expression `trials` times across `n_threads`
+// threads and prints summary statistics.
+// Every trial gets its own stream derived from `rng` (see RngTrials), so
+// for a given seed the output is the same however many threads are used.
+// Returns non-zero on failure.
+//
+static
+int
+simulate(const DiceParseExprBuffer* buff, int index, const RngState* rng, int64_t trials, int n_threads){
+    int64_t n_blocks = (trials + SIM_BLOCK_TRIALS - 1) / SIM_BLOCK_TRIALS;
+    if(n_threads <= 0)
+        n_threads = thread_num_cpus();
+    if(n_threads > n_blocks)
+        n_threads = n_blocks? (int)n_blocks : 1;
+    SimWorker* workers = calloc(n_threads, sizeof(*workers));
+    if(!workers) return 1;
+    SimStats* blocks = calloc(n_blocks? n_blocks : 1, sizeof(*blocks));
+    if(!blocks){
+        free(workers);
+        return 1;
+    }
+    int result = 0;
+    int spawned = 0;
+    int64_t block = 0;
+    for(int i = 0; i < n_threads; i++){
+        SimWorker* w = &workers[i];
+        w->buff = buff;
+        w->index = index;
+        w->rng = rng;
+        w->trials = trials;
+        w->blocks = blocks;
+        w->first_block = block;
+        block += n_blocks / n_threads + (i < n_blocks % n_threads);
+        w->end_block = block;
+        // The main thread does the first shard itself.
+        if(i == 0) continue;
+        if(thread_spawn(&w->thread, sim_worker, w)){
+            result = 1;
+            break;
+        }
+        spawned++;
+    }
+    if(!result)
+        sim_worker(&workers[0]);
+    for(int i = 0; i < n_threads; i++){
+        if(i && i <= spawned)
+            thread_join(&workers[i].thread);
+        result |= workers[i].error;
+    }
+    SimStats total = {0};
+    for(int64_t b = 0; b < n_blocks; b++)
+        simstats_merge(&total, &blocks[b]);
+    free(blocks);
+    free(workers);
+    if(result) return result;
+    double variance = total.n > 1? total.m2 / (double)(total.n - 1) : 0.;
+    printf("trials: %lld\n", (long long)total.n);
+    printf("mean:   %.6f\n", total.mean);
+    printf("stddev: %.6f\n", sqrt(variance));
+    printf("min:    %lld\n", (long long)total.min);
+    printf("max:    %lld\n", (long long)total.max);
+    return 0;
+}
+
+//
+// Prints the exact distribution of an already validated expression as
+// value/probability pairs.
+// Returns non-zero on failure.
+//
+static
+int
+print_distribution(const DiceParseExprBuffer* buff, int index){
+    DiceDist dist = {0};
+    switch(dicedist_compute(buff, index, &dist)){
+        case DICEDIST_NO_ERROR:
+            break;
+        case DICEDIST_TOO_LARGE:
+            fputs("Error: distribution is too large to compute exactly\n", stderr);
+            return 1;
+        case DICEDIST_OUT_OF_MEMORY:
+            fputs("Error: out of memory\n", stderr);
+            return 1;
+    }
+    for(size_t i = 0; i < dist.count; i++){
+        if(dist.probs[i] == 0.) continue;
+        printf("%lld %.12g\n", (long long)(dist.min + (int64_t)i), dist.probs[i]);
+    }
+    dicedist_destroy(&dist);
+    return 0;
+}
+
+//
+// Prints the mean, standard deviation and range of an already validated
+// expression without rolling it.
+//
+static
+int
+print_moments(const DiceParseExprBuffer* buff, int index){
+    DiceMoments m;
+    dicedist_moments(buff, index, &m);
+    if(m.estimated)
+        fputs("Note: the mean and variance are estimates\n", stderr);
+    printf("mean:     %.6f\n", m.mean);
+    printf("variance: %.6f\n", m.variance);
+    printf("stddev:   %.6f\n", sqrt(m.variance));
+    printf("min:      %lld\n", (long long)m.min);
+    printf("max:      %lld\n", (long long)m.max);
+    return 0;
+}
+
+//
+// Handles --moments, --dist or --simulate (whichever was given) for an
+// already validated expression of the given depth.
+// Returns non-zero on failure.
+//
+static
+int
+print_analysis(const DiceParseExprBuffer* buff, int index, uint32_t depth, bool moments, bool dist, const RngState* rng, int64_t sim_trials, int n_threads){
+    if((moments || dist) && depth > MAX_RECURSION_DEPTH){
+        fputs("Error: expression is too deeply nested\n", stderr);
+        return 1;
+    }
+    if(moments)
+        return print_moments(buff, index);
+    if(dist)
+        return print_distribution(buff, index);
+    return simulate(buff, index, rng, sim_trials, n_threads);
+}
+
+static
+void
+stop_pregen(void){
+    rngpool_stop(&rng_pool);
+}
+
+//
+// Switches rng over to words pregenerated on a helper thread, seeding the
+// helper's PCG32 lanes from rng, so the words aren't the ones rng itself
+// would have given. The helper is stopped when the process exits.
+// Returns non-zero on failure.
+//
+static
+int
+start_pregen(RngState* rng){
+    if(rngpool_start(&rng_pool, rng)){
+        fputs("Error: unable to start the pregeneration thread\n", stderr);
+        return 1;
+    }
+    atexit(stop_pregen);
+    rngpool_attach(&rng_pool, rng);
+    return 0;
+}
+
+static
+void
+interactive_mode(bool verbose, RngState* rng, const RollTable*_Nullable table) {
     puts("ctrl-d or \"q\" to exit");
     puts("\"v\" toggles verbose output");
     puts("Enter repeats last die roll");
     enum {INPUT_SIZE=1024};
     char inp[INPUT_SIZE];
-    RngState rng = {0};
-    seed_rng_auto(&rng);
     LongString prompt = {.length = sizeof(">> ")-1, .text=">> "};
     DiceParseExprBuffer buff = {0};
+    ValidateStack stack = {0};
+    DiceVmProgram prog = {0};
     for(ssize_t err_or_len = get_input_line(&history, prompt, inp, INPUT_SIZE);err_or_len >= 0; err_or_len = get_input_line(&history, prompt, inp, INPUT_SIZE)){
         LongString input = {.length = err_or_len, .text=inp};
         if(input.text[0] == 'q')
@@ -271,14 +1034,34 @@ interactive_mode(bool verbose) {
             fputs("Error when parsing dice expression.\n", stdout);
             continue;
         }
-        if(!validate(buff.exprs, buff.exprs[index])){
+        uint32_t depth;
+        if(!validate(&buff, index, &stack, &depth)){
             fputs("Error: would overflow\n", stdout);
             continue;
         }
+        if(verbose && depth > MAX_RECURSION_DEPTH){
+            fputs("Error: expression is too deeply nested to show verbosely\n", stdout);
+            continue;
+        }
+        int64_t val;
+        if(verbose){
+            uint32_t die_index = 0;
+            val = roll_and_display(&buff, buff.exprs[index], rng, &die_index, verbose, false);
+            rng_next_trial(rng);
+        }
+        else {
+            if(dicevm_compile(&prog, &buff, index, 1)){
+                fputs("Error when compiling dice expression.\n", stdout);
+                continue;
+            }
+            val = dicevm_run(&prog, rng);
+        }
         add_line_to_history(&history, input);
-        int64_t val = roll_and_display(buff.exprs, buff.exprs[index], &rng, verbose, false);
-        printf(" -> %lld\n", val);
+        print_result(table, val);
     }
+    dicevm_destroy(&prog);
+    validate_destroy(&stack);
+    diceparse_destroy(&buff);
     puts("");
     return;
 }
@@ -286,15 +1069,118 @@ interactive_mode(bool verbose) {
 int 
 main(int argc, const char** argv) {
 
+    rng_select_kernels();
     bool verbose = stdin_is_interactive();
+    int64_t count = 1;
+    int64_t sim_trials = 0;
+    int n_threads = 0;
+    bool dist = false;
+    bool moments = false;
+    RngEngine engine = RNG_PCG32;
+    uint64_t seed = 0;
+    bool pregen = false;
+    StringView table_path = {0};
+    StringView compile_table_path = {0};
+    static const LongString engine_names[] = {
+        [RNG_PCG32]      = LS("pcg32"),
+        [RNG_PCG64]      = LS("pcg64"),
+        [RNG_XOSHIRO256] = LS("xoshiro256"),
+        [RNG_PHILOX]     = LS("philox"),
+    };
+    // A pool is made with --pregen instead.
+    _Static_assert(arrlen(engine_names) == RNG_POOL, "");
+    static const ArgParseEnumType engine_enum = {
+        .enum_size = sizeof(engine),
+        .enum_count = arrlen(engine_names),
+        .enum_names = engine_names,
+    };
+    enum {KW_VERBOSE, KW_COUNT, KW_SIMULATE, KW_THREADS, KW_DIST, KW_MOMENTS, KW_RNG, KW_SEED, KW_PREGEN, KW_TABLE, KW_COMPILE_TABLE};
     ArgToParse kw_args[] = {
-        {
+        [KW_VERBOSE] = {
             .name = SV("-v"),
             .altname1 = SV("--verbose"),
             .help = "Display the individual dice rolls instead of just the total.",
             .max_num = 1,
             .dest = ARGDEST(&verbose),
         },
+        [KW_COUNT] = {
+            .name = SV("-n"),
+            .altname1 = SV("--count"),
+            .help = "Roll the expression this many times, one result per line. "
+                    "When reading from stdin, a line of the form \"count N\" "
+                    "changes this for the lines that follow.",
+            .max_num = 1,
+            .dest = ARGDEST(&count),
+            .show_default = true,
+        },
+        [KW_SIMULATE] = {
+            .name = SV("--simulate"),
+            .help = "Instead of printing rolls, roll the expression this many "
+                    "times and print the mean, standard deviation, min and max. "
+                    "For comparisons, the mean is the probability of success.",
+            .max_num = 1,
+            .dest = ARGDEST(&sim_trials),
+        },
+        [KW_THREADS] = {
+            .name = SV("--threads"),
+            .help = "How many threads to use for --simulate. 0 means one per core.",
+            .max_num = 1,
+            .dest = ARGDEST(&n_threads),
+            .show_default = true,
+        },
+        [KW_DIST] = {
+            .name = SV("--dist"),
+            .help = "Instead of rolling, print the exact probability of every "
+                    "value the expression can take.",
+            .max_num = 1,
+            .dest = ARGDEST(&dist),
+        },
+        [KW_MOMENTS] = {
+            .name = SV("--moments"),
+            .help = "Instead of rolling, print the mean, variance, standard "
+                    "deviation, min and max of the expression.",
+            .max_num = 1,
+            .dest = ARGDEST(&moments),
+        },
+        [KW_RNG] = {
+            .name = SV("--rng"),
+            .help = "Which random number generator to use.",
+            .max_num = 1,
+            .dest = ArgEnumDest(&engine, &engine_enum),
+            .show_default = true,
+        },
+        [KW_SEED] = {
+            .name = SV("--seed"),
+            .help = "Seed the random number generator with this instead of "
+                    "with entropy from the OS, so that runs can be repeated.",
+            .max_num = 1,
+            .dest = ARGDEST(&seed),
+        },
+        [KW_PREGEN] = {
+            .name = SV("--pregen"),
+            .help = "Generate random numbers ahead of time on a helper thread "
+                    "instead of as dice are rolled. Doesn't apply to --simulate. "
+                    "Only works with --rng pcg32. The numbers come from several "
+                    "pcg32 streams seeded from --seed, so a seed rolls "
+                    "differently than it does without --pregen.",
+            .max_num = 1,
+            .dest = ARGDEST(&pregen),
+        },
+        [KW_TABLE] = {
+            .name = SV("--table"),
+            .help = "A compiled table (see --compile-table). Each result is "
+                    "printed as the row of the table it lands on.",
+            .max_num = 1,
+            .dest = ARGDEST(&table_path),
+        },
+        [KW_COMPILE_TABLE] = {
+            .name = SV("--compile-table"),
+            .help = "Compile this text table, where each line is a range "
+                    "and its text like \"3-5 Hobgoblins\", into the file "
+                    "given by --table and exit.",
+            .max_num = 1,
+            .dest = ARGDEST(&compile_table_path),
+        },
     };
     StringView dice_strings[64];
     ArgToParse pos_args[] = {
@@ -340,53 +1226,167 @@ main(int argc, const char** argv) {
         print_argparse_error(&parser, parse_e);
         return parse_e;
     }
+    if(count < 0){
+        fputs("Error: count must not be negative\n", stderr);
+        return 1;
+    }
+    if(sim_trials < 0){
+        fputs("Error: number of trials must not be negative\n", stderr);
+        return 1;
+    }
+    // The helper only runs PCG32 lanes, which can't follow Philox's per-die
+    // streams or stand in for the other engines.
+    if(pregen && engine != RNG_PCG32){
+        fputs("Error: --pregen only works with --rng pcg32\n", stderr);
+        return 1;
+    }
+    if(kw_args[KW_COMPILE_TABLE].num_parsed){
+        if(!kw_args[KW_TABLE].num_parsed){
+            fputs("Error: --compile-table needs --table to say where to write it\n", stderr);
+            return 1;
+        }
+        size_t line = 0;
+        // Argument strings come from argv, so they are nul-terminated.
+        switch(rolltable_compile(compile_table_path.text, table_path.text, &line)){
+            case ROLLTABLE_NO_ERROR:
+                return 0;
+            case ROLLTABLE_PARSE_ERROR:
+                fprintf(stderr, "Error: %s:%zu: expected a range and its text\n", compile_table_path.text, line);
+                return 1;
+            case ROLLTABLE_OVERLAP:
+                fprintf(stderr, "Error: %s:%zu: range overlaps another row\n", compile_table_path.text, line);
+                return 1;
+            case ROLLTABLE_OUT_OF_MEMORY:
+                fputs("Error: out of memory\n", stderr);
+                return 1;
+            case ROLLTABLE_IO_ERROR:
+            case ROLLTABLE_BAD_FILE:
+                fputs("Error: unable to read or write the table\n", stderr);
+                return 1;
+        }
+        return 1;
+    }
+    // Mapped for the life of the process.
+    RollTable table_storage = {0};
+    const RollTable* table = NULL;
+    if(kw_args[KW_TABLE].num_parsed){
+        switch(rolltable_open(table_path.text, &table_storage)){
+            case ROLLTABLE_NO_ERROR:
+                table = &table_storage;
+                break;
+            case ROLLTABLE_BAD_FILE:
+                fprintf(stderr, "Error: %s is not a compiled table\n", table_path.text);
+                return 1;
+            default:
+                fprintf(stderr, "Error: unable to open %s\n", table_path.text);
+                return 1;
+        }
+    }
+    RngState rng = {.engine = engine};
+    if(kw_args[KW_SEED].num_parsed)
+        seed_rng_fixed(&rng, seed, seed);
+    else
+        seed_rng_auto(&rng);
 
+    // These don't roll anything, so each line of stdin is analyzed instead.
+    bool analyze = moments || dist || sim_trials;
     if(pos_args[0].num_parsed < 1){
+        if(analyze && stdin_is_interactive()){
+            fputs("Error: --moments, --dist and --simulate need an expression or piped input\n", stderr);
+            return 1;
+        }
+        if(pregen && !analyze && start_pregen(&rng))
+            return 1;
         if(stdin_is_interactive()){
             load_history(&history);
-            interactive_mode(verbose);
+            interactive_mode(verbose, &rng, table);
             dump_history(&history);
         }
         else {
-            char buff[4192];
-            RngState rng = {0};
-            seed_rng_auto(&rng);
+            LineReader reader = {0};
             DiceParseExprBuffer exprbuffer = {0};
-            while(fgets(buff, sizeof(buff), stdin)){
-                size_t length = strlen(buff);
-                buff[--length] = '\0';
-                StringView input = {.text = buff, .length = length};
+            ValidateStack stack = {0};
+            DiceVmProgram prog = {0};
+            StringView* segments;
+            size_t segment_count;
+            while(!line_reader_next(&reader, &segments, &segment_count)){
+                size_t length = 0;
+                for(size_t i = 0; i < segment_count; i++)
+                    length += segments[i].length;
+                // Commands are short, so only a short line needs to be in
+                // one piece to check for them.
+                char joined[32];
+                StringView input = {.text = joined, .length = 0};
+                if(length <= sizeof(joined)){
+                    for(size_t i = 0; i < segment_count; i++){
+                        memcpy(joined+input.length, segments[i].text, segments[i].length);
+                        input.length += segments[i].length;
+                    }
+                    segments = &input;
+                    segment_count = 1;
+                }
                 if(input.length == 1 && input.text[0] == 'v'){
                     verbose = !verbose;
                     continue;
                 }
-                int index = diceparse_parse(&exprbuffer, input);
+                if(input.length > 6 && memcmp(input.text, "count ", 6) == 0){
+                    struct Int64Result r = parse_int64(input.text+6, input.length-6);
+                    if(r.errored || r.result < 0)
+                        return 1;
+                    count = r.result;
+                    continue;
+                }
+                int index = diceparse_parse_segments(&exprbuffer, segments, segment_count);
                 if(index < 0)
                     return 1;
-                if(!validate(exprbuffer.exprs, exprbuffer.exprs[index]))
+                uint32_t depth;
+                if(!validate(&exprbuffer, index, &stack, &depth))
+                    return 1;
+                if(analyze){
+                    if(print_analysis(&exprbuffer, index, depth, moments, dist, &rng, sim_trials, n_threads))
+                        return 1;
+                    continue;
+                }
+                if(verbose && depth > MAX_RECURSION_DEPTH){
+                    fputs("Error: expression is too deeply nested to show verbosely\n", stderr);
+                    return 1;
+                }
+                if(roll_many(&exprbuffer, index, &prog, &rng, verbose, count, table))
                     return 1;
-                int64_t value = roll_and_display(exprbuffer.exprs, exprbuffer.exprs[index], &rng, verbose, false);
-                printf("%s%lld\n", verbose?" -> ":"", value);
             }
+            dicevm_destroy(&prog);
+            validate_destroy(&stack);
+            diceparse_destroy(&exprbuffer);
+            line_reader_destroy(&reader);
         }
         return 0;
     }
-    StringBuilder sb = {0};
+    // The arguments are parsed where they are, as if joined by spaces.
+    StringView segments[2*arrlen(dice_strings)];
+    size_t segment_count = 0;
     for(int i = 0; i < pos_args[0].num_parsed; i++){
-        sb_write_str(&sb, " ", 1);
-        sb_write_str(&sb, dice_strings[i].text, dice_strings[i].length);
+        segments[segment_count++] = (StringView){.length = 1, .text = " "};
+        segments[segment_count++] = dice_strings[i];
     }
-    LongString input = sb_borrow(&sb);
     DiceParseExprBuffer exprbuffer = {0};
-    RngState rng = {0};
-    seed_rng_auto(&rng);
-    int index = diceparse_parse(&exprbuffer, LS_to_SV(input));
+    int index = diceparse_parse_segments(&exprbuffer, segments, segment_count);
     if(index < 0)
         return 1;
-    if(!validate(exprbuffer.exprs, exprbuffer.exprs[index]))
+    ValidateStack stack = {0};
+    uint32_t depth;
+    if(!validate(&exprbuffer, index, &stack, &depth))
+        return 1;
+    if(analyze)
+        return print_analysis(&exprbuffer, index, depth, moments, dist, &rng, sim_trials, n_threads);
+    if(verbose && depth > MAX_RECURSION_DEPTH){
+        fputs("Error: expression is too deeply nested to show verbosely\n", stderr);
+        return 1;
+    }
+    if(pregen && start_pregen(&rng))
+        return 1;
+    DiceVmProgram prog = {0};
+    if(roll_many(&exprbuffer, index, &prog, &rng, verbose, count, table))
         return 1;
-    int64_t value = roll_and_display(exprbuffer.exprs, exprbuffer.exprs[index], &rng, verbose, false);
-    printf("%s%lld\n", verbose?" -> ":"", value);
     return 0;
 }
 
@@ -396,3 +1396,8 @@ main(int argc, const char** argv) {
 
 #include "get_input.c"
 #include "diceparse.c"
+#include "dicevm.c"
+#include "thread_utils.c"
+#include "dicedist.c"
+#include "rngpool.c"
+#include "rolltable.c"
@@ -0,0 +1,294 @@
+//
+// Copyright © 2021-2022, David Priver
+//
+#ifndef ROLLTABLE_C
+#define ROLLTABLE_C
+#ifdef _WIN32
+#define VC_EXTRALEAN
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rolltable.h"
+#include "parse_numbers.h"
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#endif
+
+static
+int
+rolltable_row_cmp(const void* a, const void* b){
+    const RollTableRow* x = a;
+    const RollTableRow* y = b;
+    return (x->lo > y->lo) - (x->lo < y->lo);
+}
+
+//
+// Parses `-?[0-9]+` from the front of `*sv`.
+// Returns non-zero if there isn't one or it doesn't fit.
+//
+static
+int
+rolltable_parse_value(StringView* sv, int64_t* out){
+    size_t n = 0;
+    if(n < sv->length && sv->text[n] == '-')
+        n++;
+    size_t digits = n;
+    while(n < sv->length && sv->text[n] >= '0' && sv->text[n] <= '9')
+        n++;
+    if(n == digits)
+        return 1;
+    struct Int64Result r = parse_int64(sv->text, n);
+    if(r.errored)
+        return 1;
+    *out = r.result;
+    sv->text += n;
+    sv->length -= n;
+    return 0;
+}
+
+static
+bool
+rolltable_is_space(char c){
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+ROLLTABLE_API
+RollTableError
+rolltable_compile(const char* src, const char* dst, size_t* line){
+    RollTableError err = ROLLTABLE_NO_ERROR;
+    char* input = NULL;
+    RollTableRow* rows = NULL;
+    FILE* fp = fopen(src, "rb");
+    if(!fp) return ROLLTABLE_IO_ERROR;
+    if(fseek(fp, 0, SEEK_END) != 0){
+        fclose(fp);
+        return ROLLTABLE_IO_ERROR;
+    }
+    long input_size = ftell(fp);
+    if(input_size < 0 || fseek(fp, 0, SEEK_SET) != 0){
+        fclose(fp);
+        return ROLLTABLE_IO_ERROR;
+    }
+    input = malloc(input_size? input_size : 1);
+    if(!input){
+        fclose(fp);
+        return ROLLTABLE_OUT_OF_MEMORY;
+    }
+    size_t nread = fread(input, 1, input_size, fp);
+    fclose(fp);
+    if(nread != (size_t)input_size){
+        err = ROLLTABLE_IO_ERROR;
+        goto done;
+    }
+    // The text of each row stays where it is in the input, so the text
+    // section is the whole input and rows just point into it. A row can't
+    // take less than two bytes, which bounds how many there are.
+    size_t row_capacity = input_size / 2 + 1;
+    rows = malloc(row_capacity * sizeof(*rows));
+    if(!rows){
+        err = ROLLTABLE_OUT_OF_MEMORY;
+        goto done;
+    }
+    size_t row_count = 0;
+    StringView rest = {.length = input_size, .text = input};
+    for(size_t lineno = 1; rest.length; lineno++){
+        const char* nl = memchr(rest.text, '\n', rest.length);
+        size_t len = nl? (size_t)(nl - rest.text) : rest.length;
+        StringView sv = {.length = len, .text = rest.text};
+        rest.text += nl? len + 1 : len;
+        rest.length -= nl? len + 1 : len;
+        while(sv.length && rolltable_is_space(sv.text[0])){
+            sv.text++;
+            sv.length--;
+        }
+        while(sv.length && rolltable_is_space(sv.text[sv.length-1]))
+            sv.length--;
+        if(!sv.length || sv.text[0] == '#')
+            continue;
+        *line = lineno;
+        int64_t lo, hi;
+        if(rolltable_parse_value(&sv, &lo)){
+            err = ROLLTABLE_PARSE_ERROR;
+            goto done;
+        }
+        hi = lo;
+        if(sv.length && sv.text[0] == '-'){
+            sv.text++;
+            sv.length--;
+            if(rolltable_parse_value(&sv, &hi)){
+                err = ROLLTABLE_PARSE_ERROR;
+                goto done;
+            }
+        }
+        if(hi < lo || (sv.length && !rolltable_is_space(sv.text[0]))){
+            err = ROLLTABLE_PARSE_ERROR;
+            goto done;
+        }
+        while(sv.length && rolltable_is_space(sv.text[0])){
+            sv.text++;
+            sv.length--;
+        }
+        rows[row_count++] = (RollTableRow){
+            .lo = lo,
+            .hi = hi,
+            .text_offset = sv.text - input,
+            .text_length = sv.length,
+        };
+    }
+    qsort(rows, row_count, sizeof(*rows), rolltable_row_cmp);
+    for(size_t i = 1; i < row_count; i++){
+        if(rows[i].lo <= rows[i-1].hi){
+            // Report whichever of the two comes later in the file.
+            uint64_t later = rows[i].text_offset > rows[i-1].text_offset? rows[i].text_offset : rows[i-1].text_offset;
+            *line = 1;
+            for(uint64_t j = 0; j < later; j++)
+                *line += input[j] == '\n';
+            err = ROLLTABLE_OVERLAP;
+            goto done;
+        }
+    }
+    RollTableHeader header = {
+        .magic = ROLLTABLE_MAGIC,
+        .row_count = row_count,
+        .text_offset = sizeof(header) + row_count * sizeof(*rows),
+        .text_size = input_size,
+    };
+    fp = fopen(dst, "wb");
+    if(!fp){
+        err = ROLLTABLE_IO_ERROR;
+        goto done;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    if(ok && row_count)
+        ok = fwrite(rows, sizeof(*rows), row_count, fp) == row_count;
+    if(ok && input_size)
+        ok = fwrite(input, 1, input_size, fp) == (size_t)input_size;
+    if(fclose(fp) != 0)
+        ok = false;
+    if(!ok)
+        err = ROLLTABLE_IO_ERROR;
+
+    done:
+    free(rows);
+    free(input);
+    return err;
+}
+
+//
+// Fills in the table from the mapped file, checking that the header is
+// consistent with its size.
+//
+static
+RollTableError
+rolltable_init(RollTable* table, const void* data, size_t size){
+    if(size < sizeof(RollTableHeader))
+        return ROLLTABLE_BAD_FILE;
+    const RollTableHeader* header = data;
+    if(memcmp(header->magic, ROLLTABLE_MAGIC, sizeof(header->magic)) != 0)
+        return ROLLTABLE_BAD_FILE;
+    uint64_t avail = size - sizeof(*header);
+    if(header->row_count > avail / sizeof(RollTableRow))
+        return ROLLTABLE_BAD_FILE;
+    if(header->text_offset > size || header->text_size > size - header->text_offset)
+        return ROLLTABLE_BAD_FILE;
+    *table = (RollTable){
+        .data = data,
+        .size = size,
+        .rows = (const RollTableRow*)(header + 1),
+        .row_count = header->row_count,
+        .text = (const char*)data + header->text_offset,
+        .text_size = header->text_size,
+    };
+    return ROLLTABLE_NO_ERROR;
+}
+
+#ifdef _WIN32
+ROLLTABLE_API
+RollTableError
+rolltable_open(const char* path, RollTable* table){
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(file == INVALID_HANDLE_VALUE)
+        return ROLLTABLE_IO_ERROR;
+    LARGE_INTEGER size;
+    if(!GetFileSizeEx(file, &size)){
+        CloseHandle(file);
+        return ROLLTABLE_IO_ERROR;
+    }
+    // Can't map an empty file.
+    if(size.QuadPart < (LONGLONG)sizeof(RollTableHeader)){
+        CloseHandle(file);
+        return ROLLTABLE_BAD_FILE;
+    }
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if(!mapping)
+        return ROLLTABLE_IO_ERROR;
+    // The view keeps the mapping alive.
+    void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if(!data)
+        return ROLLTABLE_IO_ERROR;
+    RollTableError err = rolltable_init(table, data, (size_t)size.QuadPart);
+    if(err)
+        UnmapViewOfFile(data);
+    return err;
+}
+
+ROLLTABLE_API
+void
+rolltable_close(RollTable* table){
+    if(table->data)
+        UnmapViewOfFile(table->data);
+    *table = (RollTable){0};
+}
+#else
+ROLLTABLE_API
+RollTableError
+rolltable_open(const char* path, RollTable* table){
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return ROLLTABLE_IO_ERROR;
+    struct stat st;
+    if(fstat(fd, &st) != 0){
+        close(fd);
+        return ROLLTABLE_IO_ERROR;
+    }
+    // Can't map an empty file.
+    if(st.st_size < (off_t)sizeof(RollTableHeader)){
+        close(fd);
+        return ROLLTABLE_BAD_FILE;
+    }
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps the file alive.
+    close(fd);
+    if(data == MAP_FAILED)
+        return ROLLTABLE_IO_ERROR;
+    RollTableError err = rolltable_init(table, data, st.st_size);
+    if(err)
+        munmap(data, st.st_size);
+    return err;
+}
+
+ROLLTABLE_API
+void
+rolltable_close(RollTable* table){
+    if(table->data)
+        munmap((void*)table->data, table->size);
+    *table = (RollTable){0};
+}
+#endif
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
+
+#endif
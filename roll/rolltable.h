@@ -0,0 +1,135 @@
+//
+// Copyright © 2021-2022, David Priver
+//
+#ifndef ROLLTABLE_H
+#define ROLLTABLE_H
+// Like thread_utils, this is .h and .c so that <Windows.h> stays out of
+// the header.
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "long_string.h"
+
+#ifndef ROLLTABLE_API
+#define ROLLTABLE_API extern
+#endif
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#else
+#ifndef _Null_unspecified
+#define _Null_unspecified
+#endif
+#endif
+
+//
+// A random table: rows of text, each for a range of rolled values.
+//
+// Tables are written as text, one row per line, like `3-5 Hobgoblins` or
+// `6 An owlbear`. Blank lines and lines starting with `#` are skipped.
+//
+// rolltable_compile turns that into a binary file (in native byte order):
+// a header, then the rows sorted by range, then all of the text. Opening
+// one just maps it, so it costs the same however big the table is, and a
+// lookup is a binary search over the mapping that returns text pointing
+// into it.
+//
+typedef struct RollTableHeader {
+    // ROLLTABLE_MAGIC
+    char magic[8];
+    uint64_t row_count;
+    // From the start of the file.
+    uint64_t text_offset;
+    uint64_t text_size;
+} RollTableHeader;
+
+#define ROLLTABLE_MAGIC "ROLLTBL1"
+
+typedef struct RollTableRow {
+    // Values lo through hi (inclusive) land on this row.
+    int64_t lo;
+    int64_t hi;
+    // From the start of the text.
+    uint64_t text_offset;
+    uint64_t text_length;
+} RollTableRow;
+
+_Static_assert(sizeof(RollTableHeader) % _Alignof(RollTableRow) == 0, "");
+
+typedef struct RollTable {
+    // The whole mapped file.
+    const void*_Null_unspecified data;
+    size_t size;
+    const RollTableRow*_Null_unspecified rows;
+    uint64_t row_count;
+    const char*_Null_unspecified text;
+    uint64_t text_size;
+} RollTable;
+
+typedef enum RollTableError {
+    ROLLTABLE_NO_ERROR = 0,
+    // Couldn't read, write or map a file.
+    ROLLTABLE_IO_ERROR = 1,
+    // A line of the text table isn't a range followed by text.
+    ROLLTABLE_PARSE_ERROR = 2,
+    // Two rows of the text table share a value.
+    ROLLTABLE_OVERLAP = 3,
+    // The file isn't a compiled table.
+    ROLLTABLE_BAD_FILE = 4,
+    ROLLTABLE_OUT_OF_MEMORY = 5,
+} RollTableError;
+
+//
+// Compiles the text table at `src` into a binary table at `dst`.
+// On a parse error or overlap, `*line` is the (1-based) line at fault.
+//
+ROLLTABLE_API
+RollTableError
+rolltable_compile(const char* src, const char* dst, size_t* line);
+
+//
+// Maps the compiled table at `path`. Only the header is checked, so this
+// doesn't touch the rows.
+//
+ROLLTABLE_API
+RollTableError
+rolltable_open(const char* path, RollTable* table);
+
+ROLLTABLE_API
+void
+rolltable_close(RollTable* table);
+
+//
+// Finds the row for `value`. Returns false if there isn't one.
+//
+static inline
+bool
+rolltable_lookup(const RollTable* table, int64_t value, StringView* out){
+    const RollTableRow* rows = table->rows;
+    // First row with lo > value, so the one before it is the candidate.
+    uint64_t lo = 0, hi = table->row_count;
+    while(lo < hi){
+        uint64_t mid = lo + (hi - lo) / 2;
+        if(rows[mid].lo > value)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    if(!lo) return false;
+    const RollTableRow* row = &rows[lo-1];
+    if(value > row->hi) return false;
+    // The file could be anything, so don't trust the offsets.
+    if(row->text_offset > table->text_size || row->text_length > table->text_size - row->text_offset)
+        return false;
+    *out = (StringView){
+        .length = row->text_length,
+        .text = table->text + row->text_offset,
+    };
+    return true;
+}
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
+
+#endif
@@ -0,0 +1,157 @@
+//
+// Copyright © 2021-2022, David Priver
+//
+#ifndef THREAD_UTILS_C
+#define THREAD_UTILS_C
+#ifdef _WIN32
+#define VC_EXTRALEAN
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "Synchronization.lib")
+#endif
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <time.h>
+#ifdef __linux__
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+#endif
+#include "thread_utils.h"
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#endif
+
+static inline
+void
+thread_pause(void){
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_ia32_pause();
+#elif (defined(__GNUC__) || defined(__clang__)) && defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+#ifdef _WIN32
+static
+DWORD WINAPI
+thread_trampoline(LPVOID p){
+    ThreadHandle* t = p;
+    t->func(t->arg);
+    return 0;
+}
+
+static
+int
+thread_spawn(ThreadHandle* t, ThreadFunc func, void*_Null_unspecified arg){
+    t->func = func;
+    t->arg = arg;
+    t->handle = CreateThread(NULL, 0, thread_trampoline, t, 0, NULL);
+    return t->handle == NULL;
+}
+
+static
+void
+thread_join(ThreadHandle* t){
+    WaitForSingleObject(t->handle, INFINITE);
+    CloseHandle(t->handle);
+}
+
+static
+int
+thread_num_cpus(void){
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors? (int)info.dwNumberOfProcessors : 1;
+}
+
+static
+void
+thread_wait_while(uint32_t* addr, uint32_t value){
+    WaitOnAddress(addr, &value, sizeof(value), INFINITE);
+}
+
+static
+void
+thread_wake_all(uint32_t* addr){
+    WakeByAddressAll(addr);
+}
+#else
+static
+void*_Nullable
+thread_trampoline(void* p){
+    ThreadHandle* t = p;
+    t->func(t->arg);
+    return NULL;
+}
+
+static
+int
+thread_spawn(ThreadHandle* t, ThreadFunc func, void*_Null_unspecified arg){
+    t->func = func;
+    t->arg = arg;
+    pthread_t* thread = malloc(sizeof(*thread));
+    if(!thread) return 1;
+    if(pthread_create(thread, NULL, thread_trampoline, t)){
+        free(thread);
+        return 1;
+    }
+    t->handle = thread;
+    return 0;
+}
+
+static
+void
+thread_join(ThreadHandle* t){
+    pthread_t* thread = t->handle;
+    pthread_join(*thread, NULL);
+    free(thread);
+}
+
+static
+int
+thread_num_cpus(void){
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0? (int)n : 1;
+}
+
+#ifdef __linux__
+static
+void
+thread_wait_while(uint32_t* addr, uint32_t value){
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static
+void
+thread_wake_all(uint32_t* addr){
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+#else
+// No portable futex, so poll. Callers only get here after spinning for a
+// while, so this is for when the other side is really slow.
+static
+void
+thread_wait_while(uint32_t* addr, uint32_t value){
+    if(__atomic_load_n(addr, __ATOMIC_ACQUIRE) == value)
+        nanosleep(&(struct timespec){.tv_nsec = 50000}, NULL);
+}
+
+static
+void
+thread_wake_all(uint32_t* addr){
+    (void)addr;
+}
+#endif
+#endif
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
+
+#endif
@@ -0,0 +1,44 @@
+//
+// Copyright © 2021-2022, David Priver
+//
+#ifndef THREAD_UTILS_H
+#define THREAD_UTILS_H
+// Like get_input, this is .h and .c so that <Windows.h> stays out of the
+// header.
+#include <stdint.h>
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#endif
+
+typedef void (*ThreadFunc)(void*);
+
+typedef struct ThreadHandle {
+    // pthread_t or HANDLE
+    void*_Null_unspecified handle;
+    ThreadFunc func;
+    void* _Null_unspecified arg;
+} ThreadHandle;
+
+// Starts `func(arg)` on a new thread. The handle must stay alive until it is
+// joined.
+// Returns non-zero if the thread could not be created.
+static int thread_spawn(ThreadHandle*, ThreadFunc func, void*_Null_unspecified arg);
+// Waits for the thread to finish.
+static void thread_join(ThreadHandle*);
+// Number of online processors, or 1 if unknown.
+static int thread_num_cpus(void);
+
+// Sleeps while *addr == value (a futex wait). It can return early, so the
+// caller should check again.
+static void thread_wait_while(uint32_t* addr, uint32_t value);
+// Wakes every thread sleeping on addr in thread_wait_while.
+static void thread_wake_all(uint32_t* addr);
+// Tells the cpu we're in a spin loop.
+static inline void thread_pause(void);
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
+
+#endif